@@ -43,21 +43,26 @@ void nui_free(void *ptr)
 	free(ptr);
 }
 
-void nui_buf_realloc(void **data, uint32_t *p_cap, size_t size)
+static uint32_t nui_buf_next_cap(uint32_t cap, uint32_t num, size_t size)
 {
-	uint32_t old_cap = *p_cap, cap = old_cap;
 	cap = cap ? cap * 2 : NUI_MIN_ALLOC / (uint32_t)size;
 	if (cap == 0) cap = 1;
+	while (cap < num) cap *= 2;
+	return cap;
+}
+
+void nui_buf_realloc(void **data, uint32_t *p_cap, uint32_t num, size_t size)
+{
+	uint32_t old_cap = *p_cap;
+	uint32_t cap = nui_buf_next_cap(old_cap, num, size);
 	*p_cap = cap;
 	*data = nui_realloc_uninit(*data, cap * size);
 	memset((char*)*data + old_cap * size, 0, (cap - old_cap) * size);
 }
 
-void nui_buf_realloc_uninit(void **data, uint32_t *p_cap, size_t size)
+void nui_buf_realloc_uninit(void **data, uint32_t *p_cap, uint32_t num, size_t size)
 {
-	uint32_t cap = *p_cap;
-	cap = cap ? cap * 2 : NUI_MIN_ALLOC / (uint32_t)size;
-	if (cap == 0) cap = 1;
+	uint32_t cap = nui_buf_next_cap(*p_cap, num, size);
 	*p_cap = cap;
 	*data = nui_realloc_uninit(*data, cap * size);
 }
@@ -52,7 +52,13 @@ typedef struct nui_rect {
 
 // Generic
 
-#define nui_assert(cond) do { if (!(cond)) __debugbreak(); } while (0)
+#if defined(_MSC_VER)
+	#define nui_debugbreak() __debugbreak()
+#else
+	#define nui_debugbreak() __builtin_trap()
+#endif
+
+#define nui_assert(cond) do { if (!(cond)) nui_debugbreak(); } while (0)
 #define nui_arraysize(arr) (sizeof(arr)/sizeof(*(arr)))
 
 static int32_t nui_min(int32_t x, int32_t y) {
@@ -66,6 +72,83 @@ static int32_t nui_clamp(int32_t x, int32_t min_x, int32_t max_x) {
 	return x < min_x ? min_x : x > max_x ? max_x : x;
 }
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	#define NUI_SSE2 1
+#endif
+
+// Atomics
+
+#if defined(_MSC_VER)
+	#include <intrin.h>
+	#define NUI_THREAD_LOCAL __declspec(thread)
+
+	static uint64_t nui_atomic_add64(volatile uint64_t *p, uint64_t v) {
+		return (uint64_t)_InterlockedExchangeAdd64((volatile long long*)p, (long long)v);
+	}
+	// Returns the previous value, the swap happened if it equals `expected`
+	static uint64_t nui_atomic_cas64(volatile uint64_t *p, uint64_t expected, uint64_t desired) {
+		return (uint64_t)_InterlockedCompareExchange64((volatile long long*)p, (long long)desired, (long long)expected);
+	}
+	#if defined(_M_ARM64)
+		static uint64_t nui_atomic_load64(volatile uint64_t *p) { return __ldar64((volatile unsigned __int64*)p); }
+		static void nui_atomic_store64(volatile uint64_t *p, uint64_t v) { __stlr64((volatile unsigned __int64*)p, v); }
+	#elif defined(_M_IX86)
+		// 64-bit loads and stores may tear, go through cmpxchg8b
+		static uint64_t nui_atomic_load64(volatile uint64_t *p) { return nui_atomic_cas64(p, 0, 0); }
+		static void nui_atomic_store64(volatile uint64_t *p, uint64_t v) {
+			uint64_t prev = *p;
+			for (;;) {
+				uint64_t seen = nui_atomic_cas64(p, prev, v);
+				if (seen == prev) break;
+				prev = seen;
+			}
+		}
+	#else
+		// Loads and stores are acquire and release on x64, only keep the
+		// compiler from reordering around them
+		static uint64_t nui_atomic_load64(volatile uint64_t *p) {
+			uint64_t v = (uint64_t)__iso_volatile_load64((volatile long long*)p);
+			_ReadWriteBarrier();
+			return v;
+		}
+		static void nui_atomic_store64(volatile uint64_t *p, uint64_t v) {
+			_ReadWriteBarrier();
+			__iso_volatile_store64((volatile long long*)p, (long long)v);
+		}
+	#endif
+	// Unordered, only free of tearing, eg. for data guarded by a sequence count
+	#if defined(_M_IX86)
+		static uint64_t nui_atomic_load64_relaxed(volatile uint64_t *p) { return nui_atomic_load64(p); }
+		static void nui_atomic_store64_relaxed(volatile uint64_t *p, uint64_t v) { nui_atomic_store64(p, v); }
+	#else
+		static uint64_t nui_atomic_load64_relaxed(volatile uint64_t *p) { return (uint64_t)__iso_volatile_load64((volatile long long*)p); }
+		static void nui_atomic_store64_relaxed(volatile uint64_t *p, uint64_t v) { __iso_volatile_store64((volatile long long*)p, (long long)v); }
+	#endif
+	#if defined(_M_ARM64)
+		static void nui_atomic_fence_acquire(void) { __dmb(_ARM64_BARRIER_ISHLD); }
+		static void nui_atomic_fence_release(void) { __dmb(_ARM64_BARRIER_ISH); }
+	#else
+		static void nui_atomic_fence_acquire(void) { _ReadWriteBarrier(); }
+		static void nui_atomic_fence_release(void) { _ReadWriteBarrier(); }
+	#endif
+#else
+	#define NUI_THREAD_LOCAL __thread
+
+	static uint64_t nui_atomic_add64(volatile uint64_t *p, uint64_t v) {
+		return __atomic_fetch_add(p, v, __ATOMIC_ACQ_REL);
+	}
+	static uint64_t nui_atomic_load64(volatile uint64_t *p) { return __atomic_load_n(p, __ATOMIC_ACQUIRE); }
+	static void nui_atomic_store64(volatile uint64_t *p, uint64_t v) { __atomic_store_n(p, v, __ATOMIC_RELEASE); }
+	static uint64_t nui_atomic_cas64(volatile uint64_t *p, uint64_t expected, uint64_t desired) {
+		__atomic_compare_exchange_n(p, &expected, desired, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+		return expected;
+	}
+	static uint64_t nui_atomic_load64_relaxed(volatile uint64_t *p) { return __atomic_load_n(p, __ATOMIC_RELAXED); }
+	static void nui_atomic_store64_relaxed(volatile uint64_t *p, uint64_t v) { __atomic_store_n(p, v, __ATOMIC_RELAXED); }
+	static void nui_atomic_fence_acquire(void) { __atomic_thread_fence(__ATOMIC_ACQUIRE); }
+	static void nui_atomic_fence_release(void) { __atomic_thread_fence(__ATOMIC_RELEASE); }
+#endif
+
 // nui_color
 
 static int nui_color_eq(nui_color a, nui_color b) {
@@ -146,17 +229,17 @@ void *nui_alloc_uninit(size_t size);
 void *nui_realloc_uninit(void *ptr, size_t size);
 void nui_free(void *ptr);
 
-void nui_buf_realloc(void **p_data, uint32_t *p_cap, size_t size);
-void nui_buf_realloc_uninit(void **p_data, uint32_t *p_cap, size_t size);
+void nui_buf_realloc(void **p_data, uint32_t *p_cap, uint32_t num, size_t size);
+void nui_buf_realloc_uninit(void **p_data, uint32_t *p_cap, uint32_t num, size_t size);
 
 static void nui_buf_grow_size(void **p_data, uint32_t *p_cap, uint32_t num, size_t size) {
 	if (num <= *p_cap) return;
-	nui_buf_realloc(p_data, p_cap, size);
+	nui_buf_realloc(p_data, p_cap, num, size);
 }
 
 static void nui_buf_grow_size_uninit(void **p_data, uint32_t *p_cap, uint32_t num, size_t size) {
 	if (num <= *p_cap) return;
-	nui_buf_realloc_uninit(p_data, p_cap, size);
+	nui_buf_realloc_uninit(p_data, p_cap, num, size);
 }
 
 #define nui_buf_grow(p_buf, p_cap, num) nui_buf_grow_size((void**)(p_buf), (p_cap), (num), sizeof(**(p_buf)))
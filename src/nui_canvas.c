@@ -1,15 +1,65 @@
 #include "nui_canvas.h"
+#include "nui_trace.h"
+
+#if NUI_SSE2
+	#include <emmintrin.h>
+#endif
 
 typedef struct nui_font_batch nui_font_batch;
 
+typedef enum nui_update_type {
+	nui_up_bg_color,
+	nui_up_resize,
+	nui_up_redraw,
+} nui_update_type;
+
+typedef struct nui_update {
+	nui_update_type type;
+	uint32_t index;
+	uint32_t generation; // Layer generation to detect layers freed before applying
+	nui_layer *layer;    // Resolved by `apply_updates()`, never touched by workers
+	union {
+		nui_color color;
+		nui_extent size;
+	} value;
+} nui_update;
+
+// Bounded MPSC queue, each slot's `seq` tells whether it is free for the
+// producer at `pos` (seq == pos) or published for the consumer (seq == pos + 1)
+typedef struct nui_update_slot {
+	volatile uint64_t seq;
+	nui_update update;
+} nui_update_slot;
+
+#define NUI_UPDATE_CAPACITY 1024
+#define NUI_UPDATE_MASK (NUI_UPDATE_CAPACITY - 1)
+
 struct nui_canvas {
 	nui_renderer *renderer;
 
 	nui_layer **layers;
 	uint32_t num_layers, cap_layers;
+	uint32_t *layer_generations; // Per layer slot, bumped when a layer is freed
+	uint32_t cap_layer_generations;
 
 	nui_font **fonts;
 	uint32_t num_fonts, cap_fonts;
+
+	nui_update_slot *update_slots;
+	volatile uint64_t update_head; // Next position to post
+	uint64_t update_tail;          // Next position to apply
+
+	// Drained updates being coalesced
+	nui_update *updates;
+	uint32_t cap_updates;
+
+	uint32_t frame; // Incremented by `nui_begin_rendering()`
+
+	// Scratch for batched measuring
+	const char **measure_texts;
+	size_t *measure_lens;
+	nui_extent *measure_extents;
+	uint32_t cap_measure_texts, cap_measure_lens, cap_measure_extents;
 };
 
 struct nui_font {
@@ -20,12 +70,94 @@ struct nui_font {
 	nui_font_desc desc;
 };
 
+struct nui_image {
+	nui_image_desc desc;
+	uint64_t id; // Unique across all images, unlike the address
+	uint32_t refcount;
+	uint32_t generation;
+	nui_image_release_fn *release;
+	void *user;
+};
+
+#define NUI_NO_CLIP UINT32_MAX
+
+typedef struct nui_hit_entry {
+	uint32_t draw;
+	uint32_t clip; // Innermost enclosing `nui_dt_clip_push` or `NUI_NO_CLIP`
+} nui_hit_entry;
+
+// Uniform grid over the layer area, each cell lists the positions of
+// draws overlapping it in recording order along with their clip. Rebuilt
+// lazily per layer only when the draw stream of that layer has changed.
+typedef struct nui_hit_grid {
+	uint32_t *cells; // Start of each cell in `draws`, `num_cells + 1` entries
+	uint32_t num_cells, cap_cells;
+	nui_hit_entry *draws;
+	uint32_t num_draws, cap_draws;
+	uint32_t cols, rows, shift;
+	uint32_t draws_pos; // `nui_layer.draws_pos` when built
+	int dirty;
+} nui_hit_grid;
+
+#define NUI_HIT_CELL_SHIFT 6
+#define NUI_HIT_MAX_CELLS 4096
+
 typedef struct nui_child {
 	nui_layer *layer;
 	nui_point offset;
 	uint32_t draw_pos;
+	uint32_t clip_pos; // Innermost enclosing `nui_dt_clip_push` or `NUI_NO_CLIP`
+	uint32_t parent_ix; // Index in `layer->parents` while recorded
 } nui_child;
 
+// One per `nui_dt_layer` draw of a layer, the same layer may be drawn by
+// several parents or several times by one
+typedef struct nui_parent_ref {
+	nui_layer *layer;
+	uint32_t child_ix;
+} nui_parent_ref;
+
+#define NUI_MAX_MEMO_DEPTH 16
+
+// Draw range recorded between `nui_begin_cached()` and `nui_end_cached()`
+typedef struct nui_memo {
+	uint64_t key, deps;
+	uint32_t frame; // `nui_memo_cache.frame` when last used
+	uint32_t pos;   // Position in `nui_layer.draws` when last used
+	uint32_t data, size;
+	uint32_t children, num_children;
+	uint32_t images, num_images;
+	uint32_t clip_depth;
+	nui_rect clip; // Enclosing clip, valid if `clip_depth > 0`
+} nui_memo;
+
+typedef struct nui_memo_open {
+	uint64_t key, deps;
+	uint32_t pos;
+	uint32_t child_ix;
+	uint32_t image_ix;
+	uint32_t clip_depth;
+} nui_memo_open;
+
+// Memos of the current and last frame. Draws are copied to `draws` with
+// positions relative to the start of the range, children likewise with
+// `clip_pos` of `NUI_NO_CLIP` standing for the enclosing clip.
+typedef struct nui_memo_cache {
+	nui_memo *memos;
+	uint32_t num_memos, cap_memos;
+	uint32_t *table; // Open addressing, memo index + 1
+	uint32_t cap_table;
+	char *draws;
+	uint32_t draws_size, draws_cap;
+	nui_child *children;
+	uint32_t num_children, cap_children;
+	nui_image **images; // Kept alive by the layer while the memo is usable
+	uint32_t num_images, cap_images;
+	uint32_t frame;
+	nui_memo_open open[NUI_MAX_MEMO_DEPTH];
+	uint32_t depth;
+} nui_memo_cache;
+
 struct nui_layer {
 	nui_canvas *canvas;
 	uint32_t index;
@@ -40,20 +172,105 @@ struct nui_layer {
 	nui_child *children;
 	uint32_t num_children, cap_children;
 
-	nui_layer *parent;
+	nui_parent_ref *parents;
+	uint32_t num_parents, cap_parents;
+
+	// References to the images drawn by this and the last recording, old
+	// draws may be compared against or spliced back in until the next clear
+	nui_image **images;
+	uint32_t num_images, cap_images;
+	nui_image **last_images;
+	uint32_t num_last_images, cap_last_images;
+
+	// Open `nui_push_clip()` draws while recording
+	uint32_t clip_stack[NUI_MAX_CLIP_DEPTH];
+	uint32_t clip_depth;
 
 	nui_invalidation inv;
+
+	nui_hit_grid hit;
+	nui_memo_cache memo;
+
+	nui_record_fn *record_fn;
+	void *record_user;
+
+	uint64_t draws_hash;
+	uint64_t content_hash;
+	uint32_t hash_frame; // `nui_canvas.frame` when the hashes were last updated
+
+	uint32_t update_seen; // Update types already coalesced, one bit per `nui_update_type`
+	int instanced; // Drawn more than once as of the last `nui_begin_rendering()`
+
+	nui_rect stale[NUI_MAX_STALE];
+	uint32_t num_stale;
 };
 
+static void invalidate_parents(nui_layer *l, nui_invalidation inv) {
+	uint32_t num_parents = l->num_parents;
+	for (uint32_t i = 0; i < num_parents; i++) {
+		nui_layer *parent = l->parents[i].layer;
+		if (parent->inv >= inv) continue;
+		parent->inv = inv;
+		invalidate_parents(parent, nui_inv_child);
+	}
+}
+
 static void nui_invalidate(nui_layer *l, nui_invalidation inv) {
 	if (inv > l->inv) l->inv = inv;
-	nui_layer *parent = l->parent;
-	for (; parent != NULL; parent = parent->parent) {
-		if (parent->inv >= nui_inv_child) break;
-		parent->inv = nui_inv_child;
+	invalidate_parents(l, nui_inv_child);
+}
+
+static void add_parent(nui_layer *l, uint32_t child_ix) {
+	nui_child *child = &l->children[child_ix];
+	nui_layer *cl = child->layer;
+	uint32_t ix = cl->num_parents++;
+	nui_buf_grow_uninit(&cl->parents, &cl->cap_parents, cl->num_parents);
+	cl->parents[ix].layer = l;
+	cl->parents[ix].child_ix = child_ix;
+	child->parent_ix = ix;
+}
+
+// Drop the parent references of all children recorded in `l`
+static void detach_children(nui_layer *l) {
+	uint32_t num_children = l->num_children;
+	for (uint32_t i = 0; i < num_children; i++) {
+		nui_child *child = &l->children[i];
+		nui_layer *cl = child->layer;
+		uint32_t ix = child->parent_ix;
+		nui_assert(ix < cl->num_parents && cl->parents[ix].layer == l);
+
+		uint32_t last = --cl->num_parents;
+		if (ix != last) {
+			nui_parent_ref moved = cl->parents[last];
+			cl->parents[ix] = moved;
+			moved.layer->children[moved.child_ix].parent_ix = ix;
+		}
 	}
 }
 
+// Frees everything owned by `l` without touching other layers
+static void free_layer_data(nui_layer *l) {
+	nui_free(l->draws);
+	nui_free(l->children);
+	nui_free(l->parents);
+	nui_free(l->hit.cells);
+	nui_free(l->hit.draws);
+	nui_free(l->memo.memos);
+	nui_free(l->memo.table);
+	nui_free(l->memo.draws);
+	nui_free(l->memo.children);
+	nui_free(l->memo.images);
+	for (uint32_t i = 0; i < l->num_images; i++) {
+		nui_free_image(l->images[i]);
+	}
+	for (uint32_t i = 0; i < l->num_last_images; i++) {
+		nui_free_image(l->last_images[i]);
+	}
+	nui_free(l->images);
+	nui_free(l->last_images);
+	nui_free(l);
+}
+
 // nui_canvas
 
 nui_canvas *nui_make_canvas(nui_renderer *renderer)
@@ -61,6 +278,11 @@ nui_canvas *nui_make_canvas(nui_renderer *renderer)
 	nui_canvas *c = nui_make(nui_canvas);
 	c->renderer = renderer;
 
+	c->update_slots = (nui_update_slot*)nui_alloc(NUI_UPDATE_CAPACITY * sizeof(nui_update_slot));
+	for (uint32_t i = 0; i < NUI_UPDATE_CAPACITY; i++) {
+		c->update_slots[i].seq = i;
+	}
+
 	return c;
 }
 
@@ -70,11 +292,23 @@ void nui_free_canvas(nui_canvas *c)
 
 	c->renderer->free(c->renderer);
 
+	// Children may be freed before their parents, so skip detaching them
 	for (uint32_t i = 0; i < c->num_layers; i++) {
 		if (c->layers[i] != NULL) {
-			nui_free_layer(c->layers[i]);
+			free_layer_data(c->layers[i]);
 		}
 	}
+	for (uint32_t i = 0; i < c->num_fonts; i++) {
+		nui_free(c->fonts[i]);
+	}
+	nui_free(c->layers);
+	nui_free(c->layer_generations);
+	nui_free(c->fonts);
+	nui_free(c->update_slots);
+	nui_free(c->updates);
+	nui_free(c->measure_texts);
+	nui_free(c->measure_lens);
+	nui_free(c->measure_extents);
 	nui_free(c);
 }
 
@@ -86,6 +320,7 @@ nui_layer *nui_make_layer(nui_canvas *c, nui_extent size)
 	l->canvas = c;
 
 	l->render_pos = -1;
+	l->hit.dirty = 1;
 
 	l->size.x = size.x;
 	l->size.y = size.y;
@@ -96,6 +331,7 @@ nui_layer *nui_make_layer(nui_canvas *c, nui_extent size)
 	}
 	if (index == c->num_layers) {
 		nui_buf_grow(&c->layers, &c->cap_layers, ++c->num_layers);
+		nui_buf_grow(&c->layer_generations, &c->cap_layer_generations, c->num_layers);
 	}
 	l->index = index;
 	c->layers[index] = l;
@@ -109,8 +345,12 @@ void nui_free_layer(nui_layer *l)
 
 	nui_canvas *c = l->canvas;
 	c->layers[l->index] = NULL;
-	nui_free(l->draws);
-	nui_free(l);
+	c->layer_generations[l->index]++;
+	detach_children(l);
+	if (c->renderer->release_layer) {
+		c->renderer->release_layer(c->renderer, l->index);
+	}
+	free_layer_data(l);
 }
 
 nui_extent nui_layer_size(const nui_layer *l)
@@ -122,11 +362,10 @@ void nui_resize_layer(nui_layer *l, nui_extent size)
 {
 	if (size.x == l->size.x && size.y == l->size.y) return;
 	l->size = size;
+	l->hit.dirty = 1;
 
 	nui_invalidate(l, nui_inv_self);
-	if (l->parent) {
-		nui_invalidate(l->parent, nui_inv_resize);
-	}
+	invalidate_parents(l, nui_inv_resize);
 }
 
 void nui_set_bg_color(nui_layer *l, nui_color color)
@@ -142,6 +381,11 @@ uint32_t nui_layer_index(const nui_layer *l)
 	return l->index;
 }
 
+uint32_t nui_layer_num_instances(const nui_layer *l)
+{
+	return l->num_parents;
+}
+
 nui_color nui_layer_bg_color(const nui_layer *l)
 {
 	return l->bg_color;
@@ -217,7 +461,93 @@ void nui_free_font(nui_font *font)
 
 nui_extent nui_measure_len(nui_font *font, const char *text, size_t len)
 {
-	return font->renderer->measure(font->renderer, font->index, text, len);
+	nui_trace_begin(measure);
+	nui_extent extent = font->renderer->measure(font->renderer, font->index, text, len);
+	nui_trace_end_arg(measure, "measure", "font", font->index);
+	return extent;
+}
+
+void nui_measure_many(nui_font *font, const char *const *texts, const size_t *lens, uint32_t count, nui_extent *extents)
+{
+	nui_trace_begin(measure);
+	nui_renderer *r = font->renderer;
+	if (r->measure_many) {
+		r->measure_many(r, font->index, texts, lens, count, extents);
+	} else {
+		for (uint32_t i = 0; i < count; i++) {
+			extents[i] = r->measure(r, font->index, texts[i], lens[i]);
+		}
+	}
+	nui_trace_end_arg(measure, "measure_many", "font", font->index);
+}
+
+static size_t utf8_codepoint_size(const char *text, size_t len)
+{
+	uint8_t b = (uint8_t)text[0];
+	size_t size = b >= 0xf0 ? 4 : b >= 0xe0 ? 3 : b >= 0xc0 ? 2 : 1;
+	return size < len ? size : len;
+}
+
+nui_extent nui_measure_prefixes(nui_font *font, const char *text, size_t len, int32_t *advances)
+{
+	nui_trace_begin(measure);
+	nui_renderer *r = font->renderer;
+	nui_extent extent;
+	if (r->measure_prefixes) {
+		extent = r->measure_prefixes(r, font->index, text, len, advances);
+	} else {
+		// Quadratic, but exact for renderers with kerning
+		extent = r->measure(r, font->index, text, len);
+		for (size_t i = 0; i < len; ) {
+			size_t end = i + utf8_codepoint_size(text + i, len - i);
+			int32_t width = end == len ? extent.x : r->measure(r, font->index, text, end).x;
+			for (; i < end; i++) advances[i] = width;
+		}
+	}
+	nui_trace_end_arg(measure, "measure_prefixes", "font", font->index);
+	return extent;
+}
+
+// nui_image
+
+static volatile uint64_t g_image_id;
+
+nui_image *nui_make_image(const nui_image_desc *desc, nui_image_release_fn *release, void *user)
+{
+	nui_assert(desc->width >= 0 && desc->height >= 0);
+	nui_image *image = nui_make(nui_image);
+	image->desc = *desc;
+	image->id = nui_atomic_add64(&g_image_id, 1) + 1;
+	image->refcount = 1;
+	image->release = release;
+	image->user = user;
+	return image;
+}
+
+void nui_retain_image(nui_image *image)
+{
+	image->refcount++;
+}
+
+void nui_free_image(nui_image *image)
+{
+	if (image == NULL) return;
+	if (--image->refcount > 0) return;
+
+	if (image->release) {
+		image->release(image->user, image->desc.pixels);
+	}
+	nui_free(image);
+}
+
+void nui_update_image(nui_image *image)
+{
+	image->generation++;
+}
+
+const nui_image_desc *nui_image_info(const nui_image *image)
+{
+	return &image->desc;
 }
 
 // Drawing
@@ -229,16 +559,48 @@ static uint32_t align_draw_size(size_t size)
 	return (uint32_t)s;
 }
 
+static int intersect_rect(nui_rect *r, const nui_rect *clip)
+{
+	r->left = nui_max(r->left, clip->left);
+	r->top = nui_max(r->top, clip->top);
+	r->right = nui_min(r->right, clip->right);
+	r->bottom = nui_min(r->bottom, clip->bottom);
+	return r->left < r->right && r->top < r->bottom;
+}
+
+static uint32_t current_clip(const nui_layer *l)
+{
+	return l->clip_depth > 0 ? l->clip_stack[l->clip_depth - 1] : NUI_NO_CLIP;
+}
+
+static void compact_memos(nui_memo_cache *m);
+
 void nui_clear(nui_layer *l)
 {
 	l->draws_pos = 0;
+	l->clip_depth = 0;
 
-	uint32_t num_children = l->num_children;
-	for (uint32_t i = 0; i < num_children; i++) {
-		l->children[i].layer->parent = NULL;
-	}
+	nui_memo_cache *m = &l->memo;
+	m->frame++;
+	m->depth = 0;
+	compact_memos(m);
 
+	detach_children(l);
 	l->num_children = 0;
+
+	// Images of the last recording are no longer referenced by any draw
+	// or memo once this one is done
+	for (uint32_t i = 0; i < l->num_last_images; i++) {
+		nui_free_image(l->last_images[i]);
+	}
+	nui_image **last_images = l->last_images;
+	uint32_t cap_last_images = l->cap_last_images;
+	l->last_images = l->images;
+	l->num_last_images = l->num_images;
+	l->cap_last_images = l->cap_images;
+	l->images = last_images;
+	l->num_images = 0;
+	l->cap_images = cap_last_images;
 }
 
 void nui_fill_rect(nui_layer *l, const nui_rect *r, nui_color color)
@@ -259,6 +621,7 @@ void nui_fill_rect(nui_layer *l, const nui_rect *r, nui_color color)
 
 	// Invalidate last draws and insert
 	l->render_pos = -1;
+	l->hit.dirty = 1;
 	nui_buf_grow_uninit(&l->draws, &l->draws_cap, l->draws_pos);
 	nui_rect_draw *draw = (nui_rect_draw*)(l->draws + pos);
 	draw->draw.type = nui_dt_rect;
@@ -267,7 +630,7 @@ void nui_fill_rect(nui_layer *l, const nui_rect *r, nui_color color)
 	draw->color = color;
 }
 
-void nui_draw_text_len(nui_layer *l, nui_point p, nui_font *font, nui_color color, const char *text, size_t len)
+static void draw_text(nui_layer *l, nui_point p, nui_font *font, nui_color color, const char *text, size_t len, const nui_extent *p_extent)
 {
 	uint32_t size = align_draw_size(sizeof(nui_text_draw) + len);
 	uint32_t pos = l->draws_pos;
@@ -287,10 +650,11 @@ void nui_draw_text_len(nui_layer *l, nui_point p, nui_font *font, nui_color colo
 		}
 	}
 
-	nui_extent extent = nui_measure_len(font, text, len);
+	nui_extent extent = p_extent ? *p_extent : nui_measure_len(font, text, len);
 
 	// Invalidate last draws and insert
 	l->render_pos = -1;
+	l->hit.dirty = 1;
 	nui_buf_grow_uninit(&l->draws, &l->draws_cap, l->draws_pos);
 	nui_text_draw *draw = (nui_text_draw*)(l->draws + pos);
 	draw->draw.type = nui_dt_text;
@@ -305,6 +669,16 @@ void nui_draw_text_len(nui_layer *l, nui_point p, nui_font *font, nui_color colo
 	draw->text[len] = '\0';
 }
 
+void nui_draw_text_len(nui_layer *l, nui_point p, nui_font *font, nui_color color, const char *text, size_t len)
+{
+	draw_text(l, p, font, color, text, len, NULL);
+}
+
+void nui_draw_text_sized(nui_layer *l, nui_point p, nui_font *font, nui_color color, const char *text, size_t len, nui_extent extent)
+{
+	draw_text(l, p, font, color, text, len, &extent);
+}
+
 void nui_draw_layer(nui_layer *l, nui_point p, nui_layer *inner)
 {
 	uint32_t size = align_draw_size(sizeof(nui_layer_draw));
@@ -312,9 +686,6 @@ void nui_draw_layer(nui_layer *l, nui_point p, nui_layer *inner)
 	l->draws_pos = pos + size;
 	uint32_t child_ix = l->num_children++;
 
-	nui_assert(inner->parent == NULL);
-	inner->parent = l;
-
 	// Try to re-use old draw
 	if (l->render_pos - (int32_t)pos >= (int32_t)size) {
 		nui_layer_draw *draw = (nui_layer_draw*)(l->draws + pos);
@@ -323,17 +694,20 @@ void nui_draw_layer(nui_layer *l, nui_point p, nui_layer *inner)
 			&& draw->layer == inner) {
 
 			// This must mean the child is in sync too!
-			nui_assert(l->num_children < l->cap_children);
+			nui_assert(l->num_children <= l->cap_children);
 			nui_assert(l->children[child_ix].layer == inner);
 			nui_assert(nui_point_eq(l->children[child_ix].offset, p));
 			nui_assert(l->children[child_ix].draw_pos == pos);
+			nui_assert(l->children[child_ix].clip_pos == current_clip(l));
 
+			add_parent(l, child_ix);
 			return;
 		}
 	}
 
 	// Invalidate last draws and insert
 	l->render_pos = -1;
+	l->hit.dirty = 1;
 	nui_buf_grow_uninit(&l->draws, &l->draws_cap, l->draws_pos);
 	nui_layer_draw *draw = (nui_layer_draw*)(l->draws + pos);
 	draw->draw.type = nui_dt_layer;
@@ -349,27 +723,743 @@ void nui_draw_layer(nui_layer *l, nui_point p, nui_layer *inner)
 	child->layer = inner;
 	child->offset = p;
 	child->draw_pos = pos;
+	child->clip_pos = current_clip(l);
+	add_parent(l, child_ix);
+}
+
+static void hold_images(nui_layer *l, nui_image *const *images, uint32_t count)
+{
+	nui_buf_grow_uninit(&l->images, &l->cap_images, l->num_images + count);
+	for (uint32_t i = 0; i < count; i++) {
+		images[i]->refcount++;
+		l->images[l->num_images++] = images[i];
+	}
+}
+
+void nui_draw_image(nui_layer *l, const nui_rect *dst, nui_image *image, const nui_rect *src, nui_image_filter filter)
+{
+	nui_rect sr;
+	sr.left = 0;
+	sr.top = 0;
+	sr.right = image->desc.width;
+	sr.bottom = image->desc.height;
+	if (src && !intersect_rect(&sr, src)) return;
+	// Zero-sized images have no pixels to sample
+	if (sr.left >= sr.right || sr.top >= sr.bottom) return;
+	if (dst->left >= dst->right || dst->top >= dst->bottom) return;
+
+	uint32_t size = align_draw_size(sizeof(nui_image_draw));
+	uint32_t pos = l->draws_pos;
+	l->draws_pos = pos + size;
+	hold_images(l, &image, 1);
+
+	// Try to re-use old draw
+	if (l->render_pos - (int32_t)pos >= (int32_t)size) {
+		nui_image_draw *draw = (nui_image_draw*)(l->draws + pos);
+		if (draw->draw.type == nui_dt_image
+			&& nui_rect_eq(&draw->draw.bounds, dst)
+			&& draw->image == image
+			&& draw->image_id == image->id
+			&& draw->generation == image->generation
+			&& nui_rect_eq(&draw->src, &sr)
+			&& draw->filter == filter) {
+			return;
+		}
+	}
+
+	// Invalidate last draws and insert
+	l->render_pos = -1;
+	l->hit.dirty = 1;
+	nui_buf_grow_uninit(&l->draws, &l->draws_cap, l->draws_pos);
+	nui_image_draw *draw = (nui_image_draw*)(l->draws + pos);
+	draw->draw.type = nui_dt_image;
+	draw->draw.size = size;
+	draw->draw.bounds = *dst;
+	draw->image = image;
+	draw->image_id = image->id;
+	draw->src = sr;
+	draw->generation = image->generation;
+	draw->filter = filter;
+}
+
+void nui_push_clip(nui_layer *l, const nui_rect *r)
+{
+	nui_assert(l->clip_depth < NUI_MAX_CLIP_DEPTH);
+	uint32_t size = align_draw_size(sizeof(nui_clip_draw));
+	uint32_t pos = l->draws_pos;
+	l->draws_pos = pos + size;
+
+	// Store the effective clip so renderers never need to intersect
+	nui_rect bounds = *r;
+	uint32_t outer = current_clip(l);
+	if (outer != NUI_NO_CLIP && !intersect_rect(&bounds, &((nui_draw*)(l->draws + outer))->bounds)) {
+		bounds.right = bounds.left;
+		bounds.bottom = bounds.top;
+	}
+	l->clip_stack[l->clip_depth++] = pos;
+
+	// Try to re-use old draw, `pop_offset` is checked by `nui_pop_clip()`
+	if (l->render_pos - (int32_t)pos >= (int32_t)size) {
+		nui_clip_draw *draw = (nui_clip_draw*)(l->draws + pos);
+		if (draw->draw.type == nui_dt_clip_push
+			&& nui_rect_eq(&draw->draw.bounds, &bounds)) {
+			return;
+		}
+	}
+
+	// Invalidate last draws and insert
+	l->render_pos = -1;
+	l->hit.dirty = 1;
+	nui_buf_grow_uninit(&l->draws, &l->draws_cap, l->draws_pos);
+	nui_clip_draw *draw = (nui_clip_draw*)(l->draws + pos);
+	draw->draw.type = nui_dt_clip_push;
+	draw->draw.size = size;
+	draw->draw.bounds = bounds;
+	draw->pop_offset = 0;
+}
+
+void nui_pop_clip(nui_layer *l)
+{
+	nui_assert(l->clip_depth > 0);
+	uint32_t push_pos = l->clip_stack[--l->clip_depth];
+	uint32_t size = align_draw_size(sizeof(nui_draw));
+	uint32_t pos = l->draws_pos;
+	l->draws_pos = pos + size;
+
+	// Try to re-use old draw, the push and everything in between matched
+	if (l->render_pos - (int32_t)pos >= (int32_t)size) {
+		nui_draw *draw = (nui_draw*)(l->draws + pos);
+		nui_clip_draw *push = (nui_clip_draw*)(l->draws + push_pos);
+		if (draw->type == nui_dt_clip_pop && push->pop_offset == pos - push_pos) {
+			return;
+		}
+	}
+
+	// Invalidate last draws and insert
+	l->render_pos = -1;
+	l->hit.dirty = 1;
+	nui_buf_grow_uninit(&l->draws, &l->draws_cap, l->draws_pos);
+	nui_draw *draw = (nui_draw*)(l->draws + pos);
+	draw->type = nui_dt_clip_pop;
+	draw->size = size;
+	memset(&draw->bounds, 0, sizeof(nui_rect));
+	((nui_clip_draw*)(l->draws + push_pos))->pop_offset = pos - push_pos;
+}
+
+// Returns the number of leading draws in `draws` equal to the rects
+static uint32_t match_rect_draws(const char *draws, uint32_t stride, const nui_rect *rects, const nui_color *colors, uint32_t count)
+{
+	uint32_t i = 0;
+#if NUI_SSE2
+	// Compare a whole draw as { type, size, left, top } and
+	// { right, bottom, color, padding } ignoring the padding.
+	__m128i head = _mm_set_epi32(0, 0, (int)stride, (int)nui_dt_rect);
+	for (; i < count; i++) {
+		const char *d = draws + (size_t)i * stride;
+		__m128i r = _mm_loadu_si128((const __m128i*)&rects[i]);
+		uint32_t color;
+		memcpy(&color, &colors[i], sizeof(uint32_t));
+
+		__m128i lo = _mm_unpacklo_epi64(head, r);
+		__m128i hi = _mm_unpackhi_epi64(r, _mm_slli_si128(_mm_cvtsi32_si128((int)color), 8));
+		int lo_mask = _mm_movemask_epi8(_mm_cmpeq_epi32(lo, _mm_loadu_si128((const __m128i*)d)));
+		int hi_mask = _mm_movemask_epi8(_mm_cmpeq_epi32(hi, _mm_loadu_si128((const __m128i*)(d + 16))));
+		if (lo_mask != 0xffff || (hi_mask & 0x0fff) != 0x0fff) break;
+	}
+#else
+	for (; i < count; i++) {
+		const nui_rect_draw *draw = (const nui_rect_draw*)(draws + (size_t)i * stride);
+		if (draw->draw.type != nui_dt_rect
+			|| !nui_rect_eq(&draw->draw.bounds, &rects[i])
+			|| !nui_color_eq(draw->color, colors[i])) break;
+	}
+#endif
+	return i;
+}
+
+void nui_fill_rects(nui_layer *l, const nui_rect *rects, const nui_color *colors, uint32_t count)
+{
+	if (count == 0) return;
+
+	uint32_t size = align_draw_size(sizeof(nui_rect_draw));
+	nui_assert(count <= (UINT32_MAX - l->draws_pos) / size);
+	uint32_t pos = l->draws_pos;
+	l->draws_pos = pos + size * count;
+
+	// Try to re-use a prefix of the old draws
+	uint32_t num_reused = 0;
+	if (l->render_pos > (int32_t)pos) {
+		uint32_t num_old = ((uint32_t)l->render_pos - pos) / size;
+		if (num_old > count) num_old = count;
+		num_reused = match_rect_draws(l->draws + pos, size, rects, colors, num_old);
+		if (num_reused == count) return;
+	}
+
+	// Invalidate last draws and insert the rest
+	l->render_pos = -1;
+	l->hit.dirty = 1;
+	nui_buf_grow_uninit(&l->draws, &l->draws_cap, l->draws_pos);
+	for (uint32_t i = num_reused; i < count; i++) {
+		nui_rect_draw *draw = (nui_rect_draw*)(l->draws + pos + i * size);
+		draw->draw.type = nui_dt_rect;
+		draw->draw.size = size;
+		draw->draw.bounds = rects[i];
+		draw->color = colors[i];
+	}
+}
+
+void nui_draw_texts(nui_layer *l, nui_font *font, const nui_text_item *items, uint32_t count)
+{
+	if (count == 0) return;
+
+	uint32_t font_index = font->index;
+	uint32_t pos = l->draws_pos;
+
+	// Try to re-use a prefix of the old draws
+	uint32_t i = 0;
+	for (; i < count; i++) {
+		const nui_text_item *item = &items[i];
+		uint32_t size = align_draw_size(sizeof(nui_text_draw) + item->len);
+		if (l->render_pos - (int32_t)pos < (int32_t)size) break;
+
+		nui_text_draw *draw = (nui_text_draw*)(l->draws + pos);
+		if (draw->draw.type != nui_dt_text
+			|| !nui_point_eq(draw->draw.bounds.min, item->pos)
+			|| draw->font != font_index
+			|| !nui_color_eq(draw->color, item->color)
+			|| draw->text_len != item->len
+			|| memcmp(draw->text, item->text, item->len) != 0) break;
+		pos += size;
+	}
+	l->draws_pos = pos;
+	if (i == count) return;
+
+	// Reserve space for all the remaining draws at once
+	uint32_t end = pos;
+	for (uint32_t j = i; j < count; j++) {
+		end += align_draw_size(sizeof(nui_text_draw) + items[j].len);
+	}
+
+	l->render_pos = -1;
+	l->hit.dirty = 1;
+	l->draws_pos = end;
+	nui_buf_grow_uninit(&l->draws, &l->draws_cap, end);
+
+	// Measure the remaining items in one go
+	nui_canvas *c = l->canvas;
+	uint32_t num_measure = count - i;
+	nui_buf_grow_uninit(&c->measure_texts, &c->cap_measure_texts, num_measure);
+	nui_buf_grow_uninit(&c->measure_lens, &c->cap_measure_lens, num_measure);
+	nui_buf_grow_uninit(&c->measure_extents, &c->cap_measure_extents, num_measure);
+	for (uint32_t j = 0; j < num_measure; j++) {
+		c->measure_texts[j] = items[i + j].text;
+		c->measure_lens[j] = items[i + j].len;
+	}
+	nui_measure_many(font, c->measure_texts, c->measure_lens, num_measure, c->measure_extents);
+	uint32_t first = i;
+
+	for (; i < count; i++) {
+		const nui_text_item *item = &items[i];
+		uint32_t size = align_draw_size(sizeof(nui_text_draw) + item->len);
+		nui_extent extent = c->measure_extents[i - first];
+
+		nui_text_draw *draw = (nui_text_draw*)(l->draws + pos);
+		draw->draw.type = nui_dt_text;
+		draw->draw.size = size;
+		draw->draw.bounds.min = item->pos;
+		draw->draw.bounds.max.x = item->pos.x + extent.x;
+		draw->draw.bounds.max.y = item->pos.y + extent.y;
+		draw->font = font_index;
+		draw->color = item->color;
+		draw->text_len = (uint32_t)item->len;
+		memcpy(draw->text, item->text, item->len);
+		draw->text[item->len] = '\0';
+		pos += size;
+	}
+}
+
+// Memoization
+
+static uint32_t memo_hash(uint64_t key)
+{
+	return (uint32_t)((key * 0x9e3779b97f4a7c15u) >> 32);
+}
+
+static void insert_memo_index(nui_memo_cache *m, uint32_t index)
+{
+	uint32_t mask = m->cap_table - 1;
+	uint32_t ix = memo_hash(m->memos[index].key) & mask;
+	while (m->table[ix] != 0) {
+		ix = (ix + 1) & mask;
+	}
+	m->table[ix] = index + 1;
+}
+
+static void rebuild_memo_table(nui_memo_cache *m, uint32_t cap)
+{
+	nui_free(m->table);
+	m->cap_table = cap;
+	m->table = (uint32_t*)nui_alloc(cap * sizeof(uint32_t));
+	for (uint32_t i = 0; i < m->num_memos; i++) {
+		insert_memo_index(m, i);
+	}
+}
+
+static nui_memo *find_memo(nui_memo_cache *m, uint64_t key)
+{
+	if (m->cap_table == 0) return NULL;
+	uint32_t mask = m->cap_table - 1;
+	for (uint32_t ix = memo_hash(key) & mask; m->table[ix] != 0; ix = (ix + 1) & mask) {
+		nui_memo *e = &m->memos[m->table[ix] - 1];
+		if (e->key == key) return e;
+	}
+	return NULL;
+}
+
+// Drop memos not used last frame and replaced data once they take most
+// of the storage
+static void compact_memos(nui_memo_cache *m)
+{
+	uint32_t live_size = 0;
+	for (uint32_t i = 0; i < m->num_memos; i++) {
+		const nui_memo *e = &m->memos[i];
+		if (e->frame + 1 < m->frame) continue;
+		live_size += e->size;
+	}
+	if (m->draws_size <= 2 * live_size + 4096) return;
+
+	nui_memo_cache old = *m;
+	m->draws = (char*)nui_alloc_uninit(live_size + 1);
+	m->draws_size = 0;
+	m->draws_cap = live_size + 1;
+	m->children = NULL;
+	m->num_children = 0;
+	m->cap_children = 0;
+	m->images = NULL;
+	m->num_images = 0;
+	m->cap_images = 0;
+	m->num_memos = 0;
+
+	for (uint32_t i = 0; i < old.num_memos; i++) {
+		nui_memo e = old.memos[i];
+		if (e.frame + 1 < m->frame) continue;
+
+		memcpy(m->draws + m->draws_size, old.draws + e.data, e.size);
+		e.data = m->draws_size;
+		m->draws_size += e.size;
+
+		nui_buf_grow_uninit(&m->children, &m->cap_children, m->num_children + e.num_children);
+		memcpy(m->children + m->num_children, old.children + e.children, e.num_children * sizeof(nui_child));
+		e.children = m->num_children;
+		m->num_children += e.num_children;
+
+		nui_buf_grow_uninit(&m->images, &m->cap_images, m->num_images + e.num_images);
+		memcpy(m->images + m->num_images, old.images + e.images, e.num_images * sizeof(nui_image*));
+		e.images = m->num_images;
+		m->num_images += e.num_images;
+
+		m->memos[m->num_memos++] = e;
+	}
+
+	nui_free(old.draws);
+	nui_free(old.children);
+	nui_free(old.images);
+	rebuild_memo_table(m, m->cap_table);
+}
+
+static int current_clip_rect(const nui_layer *l, nui_rect *clip)
+{
+	uint32_t pos = current_clip(l);
+	if (pos == NUI_NO_CLIP) return 0;
+	*clip = ((const nui_draw*)(l->draws + pos))->bounds;
+	return 1;
+}
+
+static void splice_memo(nui_layer *l, nui_memo *e)
+{
+	nui_memo_cache *m = &l->memo;
+	uint32_t pos = l->draws_pos;
+	uint32_t child_ix = l->num_children;
+	l->draws_pos = pos + e->size;
+	l->num_children = child_ix + e->num_children;
+	hold_images(l, m->images + e->images, e->num_images);
+
+	// The same range was recorded here last frame and everything before
+	// it matched, so draws and children are still in place
+	if (e->frame + 1 == m->frame && e->pos == pos && l->render_pos >= (int32_t)l->draws_pos) {
+		nui_assert(l->num_children <= l->cap_children);
+		for (uint32_t i = child_ix; i < l->num_children; i++) {
+			add_parent(l, i);
+		}
+		return;
+	}
+
+	// Invalidate last draws and insert
+	l->render_pos = -1;
+	l->hit.dirty = 1;
+	nui_buf_grow_uninit(&l->draws, &l->draws_cap, l->draws_pos);
+	memcpy(l->draws + pos, m->draws + e->data, e->size);
+
+	nui_buf_grow_uninit(&l->children, &l->cap_children, l->num_children);
+	uint32_t outer_clip = current_clip(l);
+	for (uint32_t i = 0; i < e->num_children; i++) {
+		nui_child *child = &l->children[child_ix + i];
+		*child = m->children[e->children + i];
+		child->draw_pos += pos;
+		child->clip_pos = child->clip_pos == NUI_NO_CLIP ? outer_clip : child->clip_pos + pos;
+
+		nui_layer *cl = child->layer;
+		add_parent(l, child_ix + i);
+
+		// The child may have been resized since recording
+		nui_draw *draw = (nui_draw*)(l->draws + child->draw_pos);
+		draw->bounds.right = draw->bounds.left + cl->size.x;
+		draw->bounds.bottom = draw->bounds.top + cl->size.y;
+	}
+}
+
+int nui_begin_cached(nui_layer *l, uint64_t key, uint64_t deps_hash)
+{
+	nui_memo_cache *m = &l->memo;
+	nui_assert(m->depth < NUI_MAX_MEMO_DEPTH);
+
+	nui_memo *e = find_memo(m, key);
+	if (e && e->deps == deps_hash && e->frame + 1 >= m->frame) {
+		// Same depth too, the pushes inside the range must fit the clip stack
+		nui_rect clip;
+		int has_clip = current_clip_rect(l, &clip);
+		if (l->clip_depth == e->clip_depth && (!has_clip || nui_rect_eq(&clip, &e->clip))) {
+			uint32_t pos = l->draws_pos;
+			splice_memo(l, e);
+			e->frame = m->frame;
+			e->pos = pos;
+			return 0;
+		}
+	}
+
+	nui_memo_open *open = &m->open[m->depth++];
+	open->key = key;
+	open->deps = deps_hash;
+	open->pos = l->draws_pos;
+	open->child_ix = l->num_children;
+	open->image_ix = l->num_images;
+	open->clip_depth = l->clip_depth;
+	return 1;
+}
+
+void nui_end_cached(nui_layer *l)
+{
+	nui_memo_cache *m = &l->memo;
+	nui_assert(m->depth > 0);
+	const nui_memo_open *open = &m->open[--m->depth];
+	nui_assert(l->clip_depth == open->clip_depth);
+
+	nui_memo *e = find_memo(m, open->key);
+	if (e == NULL) {
+		nui_buf_grow(&m->memos, &m->cap_memos, m->num_memos + 1);
+		e = &m->memos[m->num_memos++];
+		e->key = open->key;
+		if (m->num_memos * 2 > m->cap_table) {
+			rebuild_memo_table(m, nui_max(m->cap_table * 2, 64));
+		} else {
+			insert_memo_index(m, m->num_memos - 1);
+		}
+	}
+
+	// Replaced memos leave their old data behind until `compact_memos()`
+	e->deps = open->deps;
+	e->frame = m->frame;
+	e->pos = open->pos;
+	e->size = l->draws_pos - open->pos;
+	e->clip_depth = l->clip_depth;
+	current_clip_rect(l, &e->clip);
+
+	e->data = m->draws_size;
+	nui_buf_grow_uninit(&m->draws, &m->draws_cap, m->draws_size + e->size);
+	memcpy(m->draws + e->data, l->draws + open->pos, e->size);
+	m->draws_size += e->size;
+
+	e->children = m->num_children;
+	e->num_children = l->num_children - open->child_ix;
+	nui_buf_grow_uninit(&m->children, &m->cap_children, m->num_children + e->num_children);
+	for (uint32_t i = 0; i < e->num_children; i++) {
+		nui_child child = l->children[open->child_ix + i];
+		child.draw_pos -= open->pos;
+		child.clip_pos = child.clip_pos == NUI_NO_CLIP || child.clip_pos < open->pos ? NUI_NO_CLIP : child.clip_pos - open->pos;
+		m->children[m->num_children++] = child;
+	}
+
+	e->images = m->num_images;
+	e->num_images = l->num_images - open->image_ix;
+	nui_buf_grow_uninit(&m->images, &m->cap_images, m->num_images + e->num_images);
+	for (uint32_t i = 0; i < e->num_images; i++) {
+		m->images[m->num_images++] = l->images[open->image_ix + i];
+	}
+}
+
+// Updates
+
+nui_layer_ref nui_layer_get_ref(const nui_layer *l)
+{
+	nui_layer_ref ref;
+	ref.canvas = l->canvas;
+	ref.index = l->index;
+	ref.generation = l->canvas->layer_generations[l->index];
+	return ref;
+}
+
+static int post_update(nui_layer_ref ref, nui_update *update)
+{
+	nui_canvas *c = ref.canvas;
+	update->index = ref.index;
+	update->generation = ref.generation;
+	update->layer = NULL;
+	uint64_t pos = nui_atomic_load64(&c->update_head);
+	nui_update_slot *slot;
+	for (;;) {
+		slot = &c->update_slots[pos & NUI_UPDATE_MASK];
+		int64_t diff = (int64_t)(nui_atomic_load64(&slot->seq) - pos);
+		if (diff == 0) {
+			uint64_t prev = nui_atomic_cas64(&c->update_head, pos, pos + 1);
+			if (prev == pos) break;
+			pos = prev;
+		} else if (diff < 0) {
+			return 0; // Full, the slot still has an update from the last lap
+		} else {
+			pos = nui_atomic_load64(&c->update_head);
+		}
+	}
+
+	slot->update = *update;
+	nui_atomic_store64(&slot->seq, pos + 1);
+	return 1;
+}
+
+int nui_post_bg_color(nui_layer_ref ref, nui_color color)
+{
+	nui_update u;
+	u.type = nui_up_bg_color;
+	u.value.color = color;
+	return post_update(ref, &u);
+}
+
+int nui_post_resize(nui_layer_ref ref, nui_extent size)
+{
+	nui_update u;
+	u.type = nui_up_resize;
+	u.value.size = size;
+	return post_update(ref, &u);
+}
+
+int nui_post_redraw(nui_layer_ref ref)
+{
+	nui_update u;
+	u.type = nui_up_redraw;
+	return post_update(ref, &u);
+}
+
+void nui_set_record_fn(nui_layer *l, nui_record_fn *fn, void *user)
+{
+	l->record_fn = fn;
+	l->record_user = user;
+}
+
+static void apply_updates(nui_canvas *c)
+{
+	uint32_t num = 0;
+	for (;;) {
+		nui_update_slot *slot = &c->update_slots[c->update_tail & NUI_UPDATE_MASK];
+		if (nui_atomic_load64(&slot->seq) != c->update_tail + 1) break;
+		nui_buf_grow_uninit(&c->updates, &c->cap_updates, num + 1);
+		c->updates[num++] = slot->update;
+		nui_atomic_store64(&slot->seq, c->update_tail + NUI_UPDATE_CAPACITY);
+		c->update_tail++;
+	}
+	if (num == 0) return;
+
+	// Last write wins, walk backwards and drop everything already seen
+	for (uint32_t i = num; i-- > 0; ) {
+		nui_update *u = &c->updates[i];
+		if (u->index >= c->num_layers || c->layers[u->index] == NULL
+			|| c->layer_generations[u->index] != u->generation) {
+			continue;
+		}
+		nui_layer *l = c->layers[u->index];
+		if (l->update_seen & (1u << u->type)) continue;
+		l->update_seen |= 1u << u->type;
+		u->layer = l;
+	}
+
+	// Properties first so re-recording sees the final sizes
+	for (uint32_t i = 0; i < num; i++) {
+		nui_update *u = &c->updates[i];
+		if (u->layer == NULL) continue;
+		switch (u->type) {
+		case nui_up_bg_color: nui_set_bg_color(u->layer, u->value.color); break;
+		case nui_up_resize: nui_resize_layer(u->layer, u->value.size); break;
+		default: break;
+		}
+	}
+
+	for (uint32_t i = 0; i < num; i++) {
+		nui_update *u = &c->updates[i];
+		if (u->layer == NULL) continue;
+		// Record functions may free layers
+		if (c->layer_generations[u->index] != u->generation) continue;
+		u->layer->update_seen = 0;
+		if (u->type == nui_up_redraw && u->layer->record_fn) {
+			u->layer->record_fn(u->layer, u->layer->record_user);
+		}
+	}
+}
+
+// Hashing
+
+static uint64_t hash_u64(uint64_t h, uint64_t v)
+{
+	h = (h ^ v) * 0xff51afd7ed558ccdu;
+	return h ^ (h >> 32);
+}
+
+static uint64_t hash_rect(uint64_t h, const nui_rect *r)
+{
+	h = hash_u64(h, (uint64_t)(uint32_t)r->left << 32 | (uint32_t)r->top);
+	return hash_u64(h, (uint64_t)(uint32_t)r->right << 32 | (uint32_t)r->bottom);
+}
+
+static uint64_t hash_color(uint64_t h, nui_color c)
+{
+	return hash_u64(h, (uint64_t)c.r << 24 | (uint64_t)c.g << 16 | (uint64_t)c.b << 8 | c.a);
+}
+
+static uint64_t hash_bytes(uint64_t h, const char *data, size_t size)
+{
+	uint64_t v;
+	for (; size >= 8; data += 8, size -= 8) {
+		memcpy(&v, data, 8);
+		h = hash_u64(h, v);
+	}
+	v = 0;
+	memcpy(&v, data, size);
+	return hash_u64(h, v ^ (uint64_t)size << 56);
+}
+
+uint64_t nui_draw_hash(const nui_draw *d)
+{
+	uint64_t h = hash_u64(0x6a09e667f3bcc909u, d->type);
+	switch (d->type) {
+
+	case nui_dt_rect: {
+		const nui_rect_draw *draw = (const nui_rect_draw*)d;
+		h = hash_rect(h, &draw->draw.bounds);
+		h = hash_color(h, draw->color);
+	} break;
+
+	case nui_dt_text: {
+		// The extent follows from the rest
+		const nui_text_draw *draw = (const nui_text_draw*)d;
+		h = hash_u64(h, (uint64_t)(uint32_t)draw->draw.bounds.left << 32 | (uint32_t)draw->draw.bounds.top);
+		h = hash_u64(h, draw->font);
+		h = hash_color(h, draw->color);
+		h = hash_bytes(h, draw->text, draw->text_len);
+	} break;
+
+	case nui_dt_layer: {
+		// The layer itself is covered by the content hash of the parent
+		h = hash_u64(h, (uint64_t)(uint32_t)d->bounds.left << 32 | (uint32_t)d->bounds.top);
+	} break;
+
+	case nui_dt_clip_push: {
+		const nui_clip_draw *draw = (const nui_clip_draw*)d;
+		h = hash_rect(h, &draw->draw.bounds);
+		h = hash_u64(h, draw->pop_offset);
+	} break;
+
+	case nui_dt_image: {
+		// Images are identified by id, not by their pixels. The address may
+		// be reused by a later image.
+		const nui_image_draw *draw = (const nui_image_draw*)d;
+		h = hash_rect(h, &draw->draw.bounds);
+		h = hash_u64(h, draw->image_id);
+		h = hash_u64(h, (uint64_t)draw->generation << 32 | draw->filter);
+		h = hash_rect(h, &draw->src);
+	} break;
+
+	default: break;
+	}
+	return h;
+}
+
+// Hashes are only recomputed for invalidated layers, so checking whether
+// a layer is unchanged is O(1) and re-hashing a changed layer costs about
+// as much as walking its draws to render it.
+static uint64_t update_hashes(nui_canvas *c, nui_layer *l)
+{
+	if (l->inv == nui_inv_none || l->hash_frame == c->frame) return l->content_hash;
+	l->hash_frame = c->frame;
+
+	if (l->inv >= nui_inv_self) {
+		uint64_t h = 0xbb67ae8584caa73bu;
+		nui_draw *end = nui_draws_end(l);
+		for (nui_draw *d = nui_draws_begin(l); d != end; d = nui_next_draw(d)) {
+			h = hash_u64(h, nui_draw_hash(d));
+		}
+		l->draws_hash = h;
+	}
+
+	uint64_t h = hash_u64(l->draws_hash, (uint64_t)(uint32_t)l->size.x << 32 | (uint32_t)l->size.y);
+	h = hash_color(h, l->bg_color);
+	for (uint32_t i = 0; i < l->num_children; i++) {
+		h = hash_u64(h, update_hashes(c, l->children[i].layer));
+	}
+	l->content_hash = h;
+	return h;
+}
+
+uint64_t nui_layer_draws_hash(const nui_layer *l)
+{
+	return l->draws_hash;
+}
+
+uint64_t nui_layer_content_hash(const nui_layer *l)
+{
+	return l->content_hash;
 }
 
 // Rendering
 
 void nui_begin_rendering(nui_canvas *c)
 {
+	nui_trace_begin(begin);
+
+	nui_trace_begin(updates);
+	apply_updates(c);
+	nui_trace_end(updates, "apply_updates");
+
 	// Gather dirty layers
+	nui_trace_begin(gather);
 	for (uint32_t i = 0; i < c->num_layers; i++) {
 		nui_layer *l = c->layers[i];
 		if (l == NULL) continue;
+		nui_assert(l->clip_depth == 0 && l->memo.depth == 0);
 		int32_t pos = (int32_t)l->draws_pos;
 		if (pos != l->render_pos) {
 			nui_invalidate(l, nui_inv_self);
 			l->render_pos = pos;
 		}
+		int instanced = l->num_parents > 1;
+		if (l->instanced && !instanced && c->renderer->release_layer) {
+			c->renderer->release_layer(c->renderer, l->index);
+		}
+		l->instanced = instanced;
 	}
+	nui_trace_end(gather, "gather_dirty");
 
 	// Update child draw bounds
+	nui_trace_begin(bounds);
 	for (uint32_t li = 0; li < c->num_layers; li++) {
 		nui_layer *l = c->layers[li];
-		if (l == NULL && l->inv < nui_inv_resize) continue;
+		if (l == NULL || l->inv < nui_inv_resize) continue;
 
 		uint32_t num_children = l->num_children;
 		for (uint32_t i = 0; i < num_children; i++) {
@@ -379,16 +1469,31 @@ void nui_begin_rendering(nui_canvas *c)
 			draw->bounds.right = draw->bounds.left + cl->size.x;
 			draw->bounds.bottom = draw->bounds.top + cl->size.y;
 		}
+		l->hit.dirty = 1;
+	}
+	nui_trace_end(bounds, "update_bounds");
+
+	nui_trace_begin(hashes);
+	c->frame++;
+	for (uint32_t i = 0; i < c->num_layers; i++) {
+		nui_layer *l = c->layers[i];
+		if (l == NULL) continue;
+		update_hashes(c, l);
 	}
+	nui_trace_end(hashes, "update_hashes");
+
+	nui_trace_end(begin, "begin_rendering");
 }
 
 void nui_end_rendering(nui_canvas *c)
 {
+	nui_trace_begin(end);
 	for (uint32_t i = 0; i < c->num_layers; i++) {
 		nui_layer *l = c->layers[i];
 		if (l == NULL) continue;
 		l->inv = nui_inv_none;
 	}
+	nui_trace_end(end, "end_rendering");
 }
 
 nui_invalidation nui_layer_invalidation(nui_layer *l)
@@ -396,6 +1501,106 @@ nui_invalidation nui_layer_invalidation(nui_layer *l)
 	return l->inv;
 }
 
+static void add_damage(nui_rect *rects, uint32_t max_rects, uint32_t *p_num, const nui_rect *r)
+{
+	uint32_t num = *p_num;
+	if (num < max_rects) {
+		rects[num] = *r;
+		*p_num = num + 1;
+	} else {
+		nui_rect *last = &rects[max_rects - 1];
+		last->left = nui_min(last->left, r->left);
+		last->top = nui_min(last->top, r->top);
+		last->right = nui_max(last->right, r->right);
+		last->bottom = nui_max(last->bottom, r->bottom);
+	}
+}
+
+static void collect_damage(nui_layer *l, const nui_rect *clip, nui_point offset, nui_rect *rects, uint32_t max_rects, uint32_t *p_num)
+{
+	if (l->inv >= nui_inv_self) {
+		add_damage(rects, max_rects, p_num, clip);
+		return;
+	}
+	if (l->inv == nui_inv_none) return;
+
+	uint32_t num_children = l->num_children;
+	for (uint32_t i = 0; i < num_children; i++) {
+		nui_child *child = &l->children[i];
+		nui_layer *cl = child->layer;
+		if (cl->inv == nui_inv_none) continue;
+
+		nui_point co = nui_offset(offset, child->offset);
+		nui_rect cc;
+		cc.left = nui_max(clip->left, co.x);
+		cc.top = nui_max(clip->top, co.y);
+		cc.right = nui_min(clip->right, co.x + cl->size.x);
+		cc.bottom = nui_min(clip->bottom, co.y + cl->size.y);
+		if (child->clip_pos != NUI_NO_CLIP) {
+			nui_rect dc = ((nui_draw*)(l->draws + child->clip_pos))->bounds;
+			dc.min = nui_offset(dc.min, offset);
+			dc.max = nui_offset(dc.max, offset);
+			intersect_rect(&cc, &dc);
+		}
+		if (cc.left >= cc.right || cc.top >= cc.bottom) continue;
+
+		collect_damage(cl, &cc, co, rects, max_rects, p_num);
+	}
+}
+
+uint32_t nui_layer_damage(nui_layer *l, nui_rect *rects, uint32_t max_rects)
+{
+	nui_assert(max_rects > 0);
+
+	nui_rect clip;
+	clip.min = nui_pt(0, 0);
+	clip.max = nui_pt(l->size.x, l->size.y);
+
+	uint32_t num = 0;
+	collect_damage(l, &clip, nui_pt(0, 0), rects, max_rects, &num);
+	if (l->inv < nui_inv_self) {
+		for (uint32_t i = 0; i < l->num_stale; i++) {
+			add_damage(rects, max_rects, &num, &l->stale[i]);
+		}
+	}
+	return num;
+}
+
+void nui_add_stale(nui_layer *l, const nui_rect *rect)
+{
+	if (rect->left >= rect->right || rect->top >= rect->bottom) return;
+
+	// Extend a rect sharing a whole edge, eg. the next tile of a row
+	for (uint32_t i = 0; i < l->num_stale; i++) {
+		nui_rect *s = &l->stale[i];
+		if (s->left == rect->left && s->right == rect->right
+			&& s->top <= rect->bottom && rect->top <= s->bottom) {
+			s->top = nui_min(s->top, rect->top);
+			s->bottom = nui_max(s->bottom, rect->bottom);
+			return;
+		}
+		if (s->top == rect->top && s->bottom == rect->bottom
+			&& s->left <= rect->right && rect->left <= s->right) {
+			s->left = nui_min(s->left, rect->left);
+			s->right = nui_max(s->right, rect->right);
+			return;
+		}
+	}
+
+	add_damage(l->stale, NUI_MAX_STALE, &l->num_stale, rect);
+}
+
+void nui_clear_stale(nui_layer *l)
+{
+	l->num_stale = 0;
+}
+
+const nui_rect *nui_layer_stale(const nui_layer *l, uint32_t *p_num)
+{
+	*p_num = l->num_stale;
+	return l->stale;
+}
+
 nui_draw *nui_draws_begin(nui_layer *l)
 {
 	return (nui_draw*)l->draws;
@@ -405,3 +1610,176 @@ nui_draw *nui_draws_end(nui_layer *l)
 {
 	return (nui_draw*)(l->draws + l->draws_pos);
 }
+
+// Hit testing
+
+static int nui_contains(const nui_rect *r, nui_point p)
+{
+	return p.x >= r->left && p.y >= r->top && p.x < r->right && p.y < r->bottom;
+}
+
+static int hit_cell_range(const nui_layer *l, const nui_rect *bounds, nui_rect *cells)
+{
+	const nui_hit_grid *g = &l->hit;
+	int32_t left = nui_max(bounds->left, 0);
+	int32_t top = nui_max(bounds->top, 0);
+	int32_t right = nui_min(bounds->right, l->size.x);
+	int32_t bottom = nui_min(bounds->bottom, l->size.y);
+	if (left >= right || top >= bottom) return 0;
+
+	cells->left = left >> g->shift;
+	cells->top = top >> g->shift;
+	cells->right = ((right - 1) >> g->shift) + 1;
+	cells->bottom = ((bottom - 1) >> g->shift) + 1;
+	return 1;
+}
+
+typedef struct nui_hit_clips {
+	uint32_t pos[NUI_MAX_CLIP_DEPTH];
+	uint32_t depth;
+} nui_hit_clips;
+
+// Cell range of `*p_draw` limited by the enclosing clips. Clip draws are
+// never hit themselves, ranges outside of the layer are skipped entirely.
+static int hit_draw_cells(nui_layer *l, nui_draw **p_draw, nui_hit_clips *clips, nui_rect *cells)
+{
+	nui_draw *d = *p_draw;
+	if (d->type == nui_dt_clip_push) {
+		if (hit_cell_range(l, &d->bounds, cells)) {
+			clips->pos[clips->depth++] = (uint32_t)((char*)d - l->draws);
+		} else {
+			*p_draw = nui_clip_end(d);
+		}
+		return 0;
+	}
+	if (d->type == nui_dt_clip_pop) {
+		clips->depth--;
+		return 0;
+	}
+
+	nui_rect bounds = d->bounds;
+	if (clips->depth > 0) {
+		nui_draw *clip = (nui_draw*)(l->draws + clips->pos[clips->depth - 1]);
+		if (!intersect_rect(&bounds, &clip->bounds)) return 0;
+	}
+	return hit_cell_range(l, &bounds, cells);
+}
+
+static void build_hit_grid(nui_layer *l)
+{
+	nui_hit_grid *g = &l->hit;
+	nui_draw *begin = (nui_draw*)l->draws;
+	nui_draw *end = (nui_draw*)(l->draws + l->draws_pos);
+
+	uint32_t w = (uint32_t)nui_max(l->size.x, 1), h = (uint32_t)nui_max(l->size.y, 1);
+	uint32_t shift = NUI_HIT_CELL_SHIFT;
+	while ((((w - 1) >> shift) + 1) * (((h - 1) >> shift) + 1) > NUI_HIT_MAX_CELLS) {
+		shift++;
+	}
+	g->shift = shift;
+	g->cols = ((w - 1) >> shift) + 1;
+	g->rows = ((h - 1) >> shift) + 1;
+	g->num_cells = g->cols * g->rows;
+
+	nui_buf_grow_uninit(&g->cells, &g->cap_cells, g->num_cells + 1);
+	uint32_t *cells = g->cells;
+	memset(cells, 0, (g->num_cells + 1) * sizeof(uint32_t));
+
+	// Count draws per cell, offset by one for the prefix sum below
+	nui_rect cr;
+	nui_hit_clips clips;
+	clips.depth = 0;
+	for (nui_draw *d = begin; d != end; d = nui_next_draw(d)) {
+		if (!hit_draw_cells(l, &d, &clips, &cr)) continue;
+		for (int32_t y = cr.top; y < cr.bottom; y++) {
+			for (int32_t x = cr.left; x < cr.right; x++) {
+				cells[y * g->cols + x + 1]++;
+			}
+		}
+	}
+
+	uint32_t total = 0;
+	for (uint32_t i = 1; i <= g->num_cells; i++) {
+		total += cells[i];
+		cells[i] = total;
+	}
+	g->num_draws = total;
+	nui_buf_grow_uninit(&g->draws, &g->cap_draws, total);
+
+	// Scatter using `cells[i]` as a write cursor, this leaves every cell
+	// pointing to the start of the next one so shift them back in place.
+	clips.depth = 0;
+	for (nui_draw *d = begin; d != end; d = nui_next_draw(d)) {
+		if (!hit_draw_cells(l, &d, &clips, &cr)) continue;
+		nui_hit_entry entry;
+		entry.draw = (uint32_t)((char*)d - l->draws);
+		entry.clip = clips.depth > 0 ? clips.pos[clips.depth - 1] : NUI_NO_CLIP;
+		for (int32_t y = cr.top; y < cr.bottom; y++) {
+			for (int32_t x = cr.left; x < cr.right; x++) {
+				g->draws[cells[y * g->cols + x]++] = entry;
+			}
+		}
+	}
+	for (uint32_t i = g->num_cells; i > 0; i--) {
+		cells[i] = cells[i - 1];
+	}
+	cells[0] = 0;
+
+	g->draws_pos = l->draws_pos;
+	g->dirty = 0;
+}
+
+static nui_draw *hit_layer(nui_layer *l, nui_point p)
+{
+	// Draw bounds of the parent may be stale after a resize
+	if (p.x < 0 || p.y < 0 || p.x >= l->size.x || p.y >= l->size.y) return NULL;
+
+	nui_hit_grid *g = &l->hit;
+	if (g->dirty || g->draws_pos != l->draws_pos) {
+		build_hit_grid(l);
+	}
+
+	uint32_t cell = (uint32_t)(p.y >> g->shift) * g->cols + (uint32_t)(p.x >> g->shift);
+	uint32_t begin = g->cells[cell], end = g->cells[cell + 1];
+
+	// Later draws are on top so search backwards
+	for (uint32_t i = end; i > begin; i--) {
+		const nui_hit_entry *e = &g->draws[i - 1];
+		nui_draw *d = (nui_draw*)(l->draws + e->draw);
+		if (!nui_contains(&d->bounds, p)) continue;
+		if (e->clip != NUI_NO_CLIP && !nui_contains(&((nui_draw*)(l->draws + e->clip))->bounds, p)) continue;
+		return d;
+	}
+	return NULL;
+}
+
+int nui_hit_test(nui_canvas *c, nui_layer *root, nui_point point, nui_hit *hit)
+{
+	nui_assert(root->canvas == c);
+
+	hit->depth = 0;
+	hit->draw = NULL;
+	hit->point = point;
+
+	if (point.x < 0 || point.y < 0 || point.x >= root->size.x || point.y >= root->size.y) {
+		return 0;
+	}
+
+	nui_layer *l = root;
+	for (;;) {
+		nui_assert(hit->depth < NUI_MAX_HIT_DEPTH);
+		hit->layers[hit->depth++] = l;
+		hit->point = point;
+
+		nui_draw *d = hit_layer(l, point);
+		hit->draw = d;
+		if (d == NULL || d->type != nui_dt_layer) break;
+
+		nui_layer_draw *ld = (nui_layer_draw*)d;
+		point.x -= ld->draw.bounds.left;
+		point.y -= ld->draw.bounds.top;
+		l = ld->layer;
+	}
+
+	return 1;
+}
@@ -11,11 +11,15 @@ typedef struct nui_renderer nui_renderer;
 typedef struct nui_canvas nui_canvas;
 typedef struct nui_layer nui_layer;
 typedef struct nui_font nui_font;
+typedef struct nui_image nui_image;
 
 typedef enum nui_draw_type {
 	nui_dt_rect,
 	nui_dt_text,
 	nui_dt_layer,
+	nui_dt_clip_push,
+	nui_dt_clip_pop,
+	nui_dt_image,
 } nui_draw_type;
 
 typedef struct nui_draw {
@@ -42,6 +46,46 @@ typedef struct nui_layer_draw {
 	nui_layer *layer;
 } nui_layer_draw;
 
+// `bounds` is the clip rect already intersected with the enclosing clips,
+// the matching `nui_dt_clip_pop` is a bare `nui_draw` with empty bounds
+typedef struct nui_clip_draw {
+	nui_draw draw;
+	uint32_t pop_offset; // Bytes from this draw to the matching pop
+} nui_clip_draw;
+
+typedef enum nui_image_filter {
+	nui_if_nearest,
+	nui_if_bilinear,
+} nui_image_filter;
+
+// `bounds` is the destination, `src` the part of the image scaled into it
+typedef struct nui_image_draw {
+	nui_draw draw;
+	nui_image *image;
+	uint64_t image_id; // Unique, a later image may reuse the address of `image`
+	nui_rect src;
+	uint32_t generation; // Of `image` when recorded
+	nui_image_filter filter;
+} nui_image_draw;
+
+typedef struct nui_text_item {
+	nui_point pos;
+	nui_color color;
+	const char *text;
+	size_t len;
+} nui_text_item;
+
+// Pixels in `nui_pf_bgra8` layout, ie. B, G, R, A bytes not premultiplied
+typedef struct nui_image_desc {
+	const void *pixels;
+	int32_t width, height;
+	int32_t stride; // In bytes
+} nui_image_desc;
+
+// Called with the `user` pointer given to `nui_make_image()` once the last
+// reference is gone
+typedef void nui_image_release_fn(void *user, const void *pixels);
+
 typedef struct nui_render_info {
 	nui_layer *layer;
 	nui_rect clip;
@@ -58,8 +102,29 @@ struct nui_renderer {
 	void (*make_font)(nui_renderer *r, uint32_t font, const nui_font_desc *desc);
 	nui_extent (*measure)(nui_renderer *r, uint32_t font, const char *str, size_t len);
 	void (*free)(nui_renderer *r);
+
+	// Optional batched versions of `measure()`, the canvas falls back to
+	// calling `measure()` if NULL. `measure_prefixes()` stores the width of
+	// the text up to the end of the codepoint containing each byte.
+	void (*measure_many)(nui_renderer *r, uint32_t font, const char *const *strs, const size_t *lens, uint32_t count, nui_extent *extents);
+	nui_extent (*measure_prefixes)(nui_renderer *r, uint32_t font, const char *str, size_t len, int32_t *advances);
+
+	// Optional, called when the layer at index `layer` is freed or is no
+	// longer drawn more than once, renderers may drop data cached for it
+	void (*release_layer)(nui_renderer *r, uint32_t layer);
 };
 
+#define NUI_MAX_HIT_DEPTH 32
+#define NUI_MAX_CLIP_DEPTH 32
+#define NUI_MAX_STALE 16
+
+typedef struct nui_hit {
+	nui_layer *layers[NUI_MAX_HIT_DEPTH]; // Path from the root to the innermost layer
+	uint32_t depth;
+	nui_draw *draw;   // Topmost draw of the innermost layer, NULL for background
+	nui_point point;  // Hit point relative to the innermost layer
+} nui_hit;
+
 typedef enum nui_invalidation {
 	nui_inv_none,   // Everything is valid
 	nui_inv_child,  // Child has updated inside clip area
@@ -84,6 +149,11 @@ void nui_set_bg_color(nui_layer *l, nui_color color);
 uint32_t nui_layer_index(const nui_layer *l);
 nui_color nui_layer_bg_color(const nui_layer *l);
 
+// Number of `nui_draw_layer()` draws of `l` in the current recordings of
+// its parents. A layer may be drawn any number of times, invalidating it
+// invalidates every parent.
+uint32_t nui_layer_num_instances(const nui_layer *l);
+
 nui_canvas *nui_layer_canvas(const nui_layer *l);
 nui_renderer *nui_layer_renderer(const nui_layer *l);
 
@@ -97,6 +167,30 @@ static nui_extent nui_measure(nui_font *font, const char *text) {
 	return nui_measure_len(font, text, strlen(text));
 }
 
+// Measure `count` strings at once
+void nui_measure_many(nui_font *font, const char *const *texts, const size_t *lens, uint32_t count, nui_extent *extents);
+
+// Measure `text` and store the cumulative width up to the end of each
+// codepoint in `advances`, one entry per byte. A caret before byte `i`
+// (`i > 0`, on a codepoint boundary) is at `advances[i - 1]`.
+nui_extent nui_measure_prefixes(nui_font *font, const char *text, size_t len, int32_t *advances);
+
+// nui_image
+
+// Wraps externally owned pixels without copying them, `release` may be NULL.
+// Layers keep a reference to the images they draw until the draws can no
+// longer be reused, so the creator may free the image right after drawing.
+nui_image *nui_make_image(const nui_image_desc *desc, nui_image_release_fn *release, void *user);
+void nui_retain_image(nui_image *image);
+// Drops a reference
+void nui_free_image(nui_image *image);
+
+// Mark the pixels as modified, layers drawing the image need to be
+// recorded again to pick up the change
+void nui_update_image(nui_image *image);
+
+const nui_image_desc *nui_image_info(const nui_image *image);
+
 // Drawing
 
 void nui_clear(nui_layer *l);
@@ -105,7 +199,64 @@ void nui_draw_text_len(nui_layer *l, nui_point pos, nui_font *font, nui_color co
 static void nui_draw_text(nui_layer *l, nui_point pos, nui_font *font, nui_color color, const char *text) {
 	nui_draw_text_len(l, pos, font, color, text, strlen(text));
 }
+// Like `nui_draw_text_len()` but with an already measured `extent`
+void nui_draw_text_sized(nui_layer *l, nui_point pos, nui_font *font, nui_color color, const char *text, size_t len, nui_extent extent);
 void nui_draw_layer(nui_layer *l, nui_point pos, nui_layer *inner);
+// Scale `src` (NULL for the whole image) of `image` to `dst`, only a
+// reference to the pixels is recorded
+void nui_draw_image(nui_layer *l, const nui_rect *dst, nui_image *image, const nui_rect *src, nui_image_filter filter);
+
+// Clip the draws up to the matching `nui_pop_clip()` to `r`, a cheap
+// alternative to a child layer. Renderers skip the whole range at once when
+// it doesn't intersect the area they're drawing.
+void nui_push_clip(nui_layer *l, const nui_rect *r);
+void nui_pop_clip(nui_layer *l);
+
+// Memoized recording for immediate mode UIs. If `key` was recorded into `l`
+// this or last frame with the same `deps_hash` its draws and child layers
+// are spliced back in and this returns zero. Otherwise returns nonzero and
+// everything up to `nui_end_cached()` is recorded as usual and remembered.
+//
+//   if (nui_begin_cached(l, widget_id, widget_hash)) {
+//       draw_widget(l, widget);
+//       nui_end_cached(l);
+//   }
+int nui_begin_cached(nui_layer *l, uint64_t key, uint64_t deps_hash);
+void nui_end_cached(nui_layer *l);
+
+// Batched versions of `nui_fill_rect()` and `nui_draw_text_len()`, the
+// result is identical to recording the items one by one.
+void nui_fill_rects(nui_layer *l, const nui_rect *rects, const nui_color *colors, uint32_t count);
+void nui_draw_texts(nui_layer *l, nui_font *font, const nui_text_item *items, uint32_t count);
+
+// Cross-thread updates
+//
+// May be called from any thread without locking. Updates are queued and
+// applied at the start of the next `nui_begin_rendering()`, only the last
+// one per layer and property takes effect. Return zero if the queue is
+// full, updates to layers freed in the meantime are dropped.
+//
+// Updates address layers through a `nui_layer_ref` taken on the rendering
+// thread, the layer itself may be freed while a worker still holds the
+// reference. The canvas must outlive all posts.
+
+typedef struct nui_layer_ref {
+	nui_canvas *canvas;
+	uint32_t index;
+	uint32_t generation; // Of the layer slot `index`, bumped when freed
+} nui_layer_ref;
+
+nui_layer_ref nui_layer_get_ref(const nui_layer *l);
+
+int nui_post_bg_color(nui_layer_ref ref, nui_color color);
+int nui_post_resize(nui_layer_ref ref, nui_extent size);
+// Calls the record function of the layer, see `nui_set_record_fn()`
+int nui_post_redraw(nui_layer_ref ref);
+
+// Re-records `l` on the rendering thread, usually `nui_clear()` followed by
+// the draws of the layer
+typedef void nui_record_fn(nui_layer *l, void *user);
+void nui_set_record_fn(nui_layer *l, nui_record_fn *fn, void *user);
 
 // Rendering
 
@@ -114,11 +265,42 @@ void nui_end_rendering(nui_canvas *c);
 
 nui_invalidation nui_layer_invalidation(nui_layer *l);
 
+// Content hashes, updated by `nui_begin_rendering()`. The draws hash covers
+// the draw stream of `l` alone, the content hash also its size, background
+// and the content of its children, so two layers with the same content hash
+// render identically. `nui_draw_hash()` hashes a single draw.
+uint64_t nui_layer_draws_hash(const nui_layer *l);
+uint64_t nui_layer_content_hash(const nui_layer *l);
+uint64_t nui_draw_hash(const nui_draw *d);
+
+// Areas of `l` that will be re-rendered this frame, valid between
+// `nui_begin_rendering()` and `nui_end_rendering()`. Rects past
+// `max_rects` are merged into the last one.
+uint32_t nui_layer_damage(nui_layer *l, nui_rect *rects, uint32_t max_rects);
+
+// Areas of `l` a progressive renderer didn't get to, in the coordinates of
+// `l`. They stay part of `nui_layer_damage()` across frames until cleared.
+// Adjacent rects are joined, past `NUI_MAX_STALE` they are merged into the
+// last one.
+void nui_add_stale(nui_layer *l, const nui_rect *rect);
+void nui_clear_stale(nui_layer *l);
+const nui_rect *nui_layer_stale(const nui_layer *l, uint32_t *p_num);
+
 nui_draw *nui_draws_begin(nui_layer *l);
 nui_draw *nui_draws_end(nui_layer *l);
 static nui_draw *nui_next_draw(nui_draw *d) {
 	return (nui_draw*)((char*)d + d->size);
 }
+// The `nui_dt_clip_pop` matching the `nui_dt_clip_push` draw `d`
+static nui_draw *nui_clip_end(nui_draw *d) {
+	return (nui_draw*)((char*)d + ((nui_clip_draw*)d)->pop_offset);
+}
+
+// Hit testing
+
+// Find the topmost draw under `point` (relative to `root`), descending into
+// child layers. Returns zero if the point is outside of `root`.
+int nui_hit_test(nui_canvas *c, nui_layer *root, nui_point point, nui_hit *hit);
 
 
 #ifdef __cplusplus
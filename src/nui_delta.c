@@ -0,0 +1,350 @@
+#include "nui_delta.h"
+#include <string.h>
+
+// Stream layout, all values little-endian:
+//   header:  u32 magic, u16 width, u16 height, u8 format, u8 pad, u16 pad, u32 num_tiles
+//   tile:    u16 tile_x, u16 tile_y, u8 type, payload
+//   solid:   pixel
+//   palette: u8 count, count * pixel, indices packed LSB first at 1, 2 or 4 bits
+//   rle:     u16 num_runs, num_runs * (u8 length - 1, pixel)
+//   raw:     every pixel in the tile row by row
+// Pixels are stored with the size of the surface format.
+
+#define NUI_DELTA_MAGIC 0x4455494eu // "NUID"
+#define NUI_DELTA_HEADER_SIZE 16
+#define NUI_DELTA_TILE_PIXELS (NUI_DELTA_TILE * NUI_DELTA_TILE)
+#define NUI_DELTA_MAX_PALETTE 16
+
+typedef enum nui_delta_tile_type {
+	nui_dtt_solid,
+	nui_dtt_palette,
+	nui_dtt_rle,
+	nui_dtt_raw,
+} nui_delta_tile_type;
+
+struct nui_delta_encoder {
+	nui_extent size;
+	nui_pixel_format format;
+	uint32_t pixel_size;
+	uint32_t tiles_x, tiles_y;
+
+	// Previous frame as seen by the decoder
+	uint32_t *prev;
+	int keyframe;
+
+	uint8_t *tile_mask;
+
+	uint8_t *data;
+	uint32_t data_size, data_cap;
+};
+
+static uint32_t load_pixel(const uint8_t *p, uint32_t size)
+{
+	switch (size) {
+	case 1: return p[0];
+	case 2: return (uint32_t)p[0] | (uint32_t)p[1] << 8;
+	default: return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+	}
+}
+
+static void store_pixel(uint8_t *p, uint32_t size, uint32_t v)
+{
+	for (uint32_t i = 0; i < size; i++) {
+		p[i] = (uint8_t)(v >> (i * 8));
+	}
+}
+
+static uint8_t *reserve(nui_delta_encoder *e, uint32_t size)
+{
+	nui_buf_grow_uninit(&e->data, &e->data_cap, e->data_size + size);
+	uint8_t *p = e->data + e->data_size;
+	e->data_size += size;
+	return p;
+}
+
+static void write_u8(nui_delta_encoder *e, uint32_t v) { *reserve(e, 1) = (uint8_t)v; }
+static void write_u16(nui_delta_encoder *e, uint32_t v) { store_pixel(reserve(e, 2), 2, v); }
+static void write_u32(nui_delta_encoder *e, uint32_t v) { store_pixel(reserve(e, 4), 4, v); }
+static void write_pixel(nui_delta_encoder *e, uint32_t v) { store_pixel(reserve(e, e->pixel_size), e->pixel_size, v); }
+
+nui_delta_encoder *nui_make_delta_encoder(nui_extent size, nui_pixel_format format)
+{
+	nui_assert(size.x > 0 && size.y > 0 && size.x <= UINT16_MAX && size.y <= UINT16_MAX);
+
+	nui_delta_encoder *e = nui_make(nui_delta_encoder);
+	e->size = size;
+	e->format = format;
+	e->pixel_size = nui_pixel_size(format);
+	e->tiles_x = (uint32_t)(size.x + NUI_DELTA_TILE - 1) / NUI_DELTA_TILE;
+	e->tiles_y = (uint32_t)(size.y + NUI_DELTA_TILE - 1) / NUI_DELTA_TILE;
+	e->prev = (uint32_t*)nui_alloc((size_t)size.x * size.y * sizeof(uint32_t));
+	e->tile_mask = (uint8_t*)nui_alloc(e->tiles_x * e->tiles_y);
+	e->keyframe = 1;
+	return e;
+}
+
+void nui_free_delta_encoder(nui_delta_encoder *e)
+{
+	if (e == NULL) return;
+	nui_free(e->prev);
+	nui_free(e->tile_mask);
+	nui_free(e->data);
+	nui_free(e);
+}
+
+void nui_delta_reset(nui_delta_encoder *e)
+{
+	e->keyframe = 1;
+}
+
+static void mark_tiles(nui_delta_encoder *e, const nui_rect *r)
+{
+	int32_t left = nui_max(r->left, 0), top = nui_max(r->top, 0);
+	int32_t right = nui_min(r->right, e->size.x), bottom = nui_min(r->bottom, e->size.y);
+	if (left >= right || top >= bottom) return;
+
+	for (int32_t ty = top / NUI_DELTA_TILE; ty <= (bottom - 1) / NUI_DELTA_TILE; ty++) {
+		for (int32_t tx = left / NUI_DELTA_TILE; tx <= (right - 1) / NUI_DELTA_TILE; tx++) {
+			e->tile_mask[ty * e->tiles_x + tx] = 1;
+		}
+	}
+}
+
+static uint32_t palette_bits(uint32_t count)
+{
+	return count <= 2 ? 1 : count <= 4 ? 2 : 4;
+}
+
+static void encode_tile(nui_delta_encoder *e, const uint32_t *px, uint32_t count, uint32_t tx, uint32_t ty)
+{
+	uint32_t palette[NUI_DELTA_MAX_PALETTE];
+	uint32_t num_palette = 0;
+	uint32_t num_runs = 0;
+
+	for (uint32_t i = 0; i < count; i++) {
+		if (i == 0 || px[i] != px[i - 1]) num_runs++;
+		if (num_palette > NUI_DELTA_MAX_PALETTE) continue;
+		uint32_t j = 0;
+		while (j < num_palette && palette[j] != px[i]) j++;
+		if (j == num_palette) {
+			if (num_palette < NUI_DELTA_MAX_PALETTE) palette[j] = px[i];
+			num_palette++;
+		}
+	}
+
+	write_u16(e, tx);
+	write_u16(e, ty);
+
+	if (num_palette == 1) {
+		write_u8(e, nui_dtt_solid);
+		write_pixel(e, px[0]);
+		return;
+	}
+
+	uint32_t ps = e->pixel_size;
+	uint32_t raw_size = count * ps;
+	uint32_t rle_size = 2 + num_runs * (1 + ps);
+	uint32_t pal_size = UINT32_MAX;
+	if (num_palette <= NUI_DELTA_MAX_PALETTE) {
+		pal_size = 1 + num_palette * ps + (count * palette_bits(num_palette) + 7) / 8;
+	}
+
+	if (pal_size <= rle_size && pal_size <= raw_size) {
+		write_u8(e, nui_dtt_palette);
+		write_u8(e, num_palette);
+		for (uint32_t i = 0; i < num_palette; i++) {
+			write_pixel(e, palette[i]);
+		}
+		uint32_t bits = palette_bits(num_palette);
+		uint32_t size = (count * bits + 7) / 8;
+		uint8_t *dst = reserve(e, size);
+		memset(dst, 0, size);
+		for (uint32_t i = 0; i < count; i++) {
+			uint32_t ix = 0;
+			while (palette[ix] != px[i]) ix++;
+			uint32_t bit = i * bits;
+			dst[bit >> 3] |= (uint8_t)(ix << (bit & 7));
+		}
+	} else if (rle_size <= raw_size) {
+		write_u8(e, nui_dtt_rle);
+		write_u16(e, num_runs);
+		for (uint32_t i = 0; i < count; ) {
+			uint32_t len = 1;
+			while (i + len < count && len < 256 && px[i + len] == px[i]) len++;
+			write_u8(e, len - 1);
+			write_pixel(e, px[i]);
+			i += len;
+		}
+	} else {
+		write_u8(e, nui_dtt_raw);
+		for (uint32_t i = 0; i < count; i++) {
+			write_pixel(e, px[i]);
+		}
+	}
+}
+
+const void *nui_delta_encode(nui_delta_encoder *e, const nui_surface *frame, const nui_rect *damage, uint32_t num_damage, size_t *p_size)
+{
+	nui_assert(frame->width == e->size.x && frame->height == e->size.y && frame->format == e->format);
+
+	uint32_t num_tiles_total = e->tiles_x * e->tiles_y;
+	if (e->keyframe) {
+		memset(e->tile_mask, 1, num_tiles_total);
+	} else {
+		memset(e->tile_mask, 0, num_tiles_total);
+		for (uint32_t i = 0; i < num_damage; i++) {
+			mark_tiles(e, &damage[i]);
+		}
+	}
+
+	e->data_size = 0;
+	write_u32(e, NUI_DELTA_MAGIC);
+	write_u16(e, (uint32_t)e->size.x);
+	write_u16(e, (uint32_t)e->size.y);
+	write_u8(e, (uint32_t)e->format);
+	write_u8(e, 0);
+	write_u16(e, 0);
+	write_u32(e, 0);
+
+	uint32_t num_tiles = 0;
+	uint32_t tile[NUI_DELTA_TILE_PIXELS];
+	for (uint32_t ty = 0; ty < e->tiles_y; ty++) {
+		for (uint32_t tx = 0; tx < e->tiles_x; tx++) {
+			if (!e->tile_mask[ty * e->tiles_x + tx]) continue;
+
+			int32_t x0 = (int32_t)tx * NUI_DELTA_TILE, y0 = (int32_t)ty * NUI_DELTA_TILE;
+			int32_t w = nui_min(NUI_DELTA_TILE, e->size.x - x0);
+			int32_t h = nui_min(NUI_DELTA_TILE, e->size.y - y0);
+
+			// Gather the tile and skip it if it matches the previous frame
+			int changed = e->keyframe;
+			uint32_t count = 0;
+			for (int32_t y = y0; y < y0 + h; y++) {
+				const uint8_t *src = (const uint8_t*)frame->pixels + (size_t)y * frame->stride + (size_t)x0 * e->pixel_size;
+				uint32_t *prev = e->prev + (size_t)y * e->size.x + x0;
+				for (int32_t x = 0; x < w; x++) {
+					uint32_t v = load_pixel(src + x * e->pixel_size, e->pixel_size);
+					changed |= v != prev[x];
+					prev[x] = v;
+					tile[count++] = v;
+				}
+			}
+			if (!changed) continue;
+
+			encode_tile(e, tile, count, tx, ty);
+			num_tiles++;
+		}
+	}
+
+	store_pixel(e->data + 12, 4, num_tiles);
+	e->keyframe = 0;
+
+	*p_size = e->data_size;
+	return e->data;
+}
+
+// Parse `num_tiles` tiles from `p`, copying them into `dst` only if `write`
+// is set. Returns zero on malformed data.
+static int decode_tiles(nui_surface *dst, const uint8_t *p, const uint8_t *end, uint32_t num_tiles, int write)
+{
+	uint32_t ps = nui_pixel_size(dst->format);
+	uint32_t tile[NUI_DELTA_TILE_PIXELS];
+
+	for (uint32_t t = 0; t < num_tiles; t++) {
+		if (end - p < 5) return 0;
+		int32_t x0 = (int32_t)load_pixel(p, 2) * NUI_DELTA_TILE;
+		int32_t y0 = (int32_t)load_pixel(p + 2, 2) * NUI_DELTA_TILE;
+		uint32_t type = p[4];
+		p += 5;
+		if (x0 >= dst->width || y0 >= dst->height) return 0;
+
+		int32_t w = nui_min(NUI_DELTA_TILE, dst->width - x0);
+		int32_t h = nui_min(NUI_DELTA_TILE, dst->height - y0);
+		uint32_t count = (uint32_t)(w * h);
+
+		switch (type) {
+
+		case nui_dtt_solid: {
+			if ((size_t)(end - p) < ps) return 0;
+			uint32_t v = load_pixel(p, ps);
+			p += ps;
+			for (uint32_t i = 0; i < count; i++) tile[i] = v;
+		} break;
+
+		case nui_dtt_palette: {
+			if (end - p < 1) return 0;
+			uint32_t num_palette = *p++;
+			if (num_palette == 0 || num_palette > NUI_DELTA_MAX_PALETTE) return 0;
+			uint32_t bits = palette_bits(num_palette);
+			uint32_t index_size = (count * bits + 7) / 8;
+			if ((size_t)(end - p) < num_palette * ps + index_size) return 0;
+
+			uint32_t palette[NUI_DELTA_MAX_PALETTE];
+			for (uint32_t i = 0; i < num_palette; i++, p += ps) {
+				palette[i] = load_pixel(p, ps);
+			}
+			uint32_t mask = (1u << bits) - 1;
+			for (uint32_t i = 0; i < count; i++) {
+				uint32_t bit = i * bits;
+				uint32_t ix = (p[bit >> 3] >> (bit & 7)) & mask;
+				if (ix >= num_palette) return 0;
+				tile[i] = palette[ix];
+			}
+			p += index_size;
+		} break;
+
+		case nui_dtt_rle: {
+			if (end - p < 2) return 0;
+			uint32_t num_runs = load_pixel(p, 2);
+			p += 2;
+			uint32_t i = 0;
+			for (uint32_t r = 0; r < num_runs; r++) {
+				if ((size_t)(end - p) < 1 + ps) return 0;
+				uint32_t len = (uint32_t)p[0] + 1;
+				uint32_t v = load_pixel(p + 1, ps);
+				p += 1 + ps;
+				if (i + len > count) return 0;
+				for (uint32_t j = 0; j < len; j++) tile[i++] = v;
+			}
+			if (i != count) return 0;
+		} break;
+
+		case nui_dtt_raw: {
+			if ((size_t)(end - p) < count * ps) return 0;
+			for (uint32_t i = 0; i < count; i++, p += ps) {
+				tile[i] = load_pixel(p, ps);
+			}
+		} break;
+
+		default: return 0;
+		}
+
+		if (!write) continue;
+
+		uint32_t i = 0;
+		for (int32_t y = y0; y < y0 + h; y++) {
+			uint8_t *row = (uint8_t*)dst->pixels + (size_t)y * dst->stride + (size_t)x0 * ps;
+			for (int32_t x = 0; x < w; x++) {
+				store_pixel(row + x * ps, ps, tile[i++]);
+			}
+		}
+	}
+
+	return 1;
+}
+
+int nui_delta_decode(nui_surface *dst, const void *data, size_t size)
+{
+	const uint8_t *p = (const uint8_t*)data, *end = p + size;
+	if (size < NUI_DELTA_HEADER_SIZE) return 0;
+	if (load_pixel(p, 4) != NUI_DELTA_MAGIC) return 0;
+	if ((int32_t)load_pixel(p + 4, 2) != dst->width || (int32_t)load_pixel(p + 6, 2) != dst->height) return 0;
+	if (p[8] != (uint8_t)dst->format) return 0;
+	uint32_t num_tiles = load_pixel(p + 12, 4);
+	p += NUI_DELTA_HEADER_SIZE;
+
+	// Validate everything first so bad data leaves `dst` untouched
+	if (!decode_tiles(dst, p, end, num_tiles, 0)) return 0;
+	decode_tiles(dst, p, end, num_tiles, 1);
+	return 1;
+}
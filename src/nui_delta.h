@@ -0,0 +1,36 @@
+#pragma once
+
+#include "nui_renderer_soft.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Tile based delta stream for remote sessions. Only tiles inside the
+// damage rects that differ from the previously encoded frame are sent,
+// each as a solid color, palette, run-length or raw block, whichever is
+// smallest.
+
+#define NUI_DELTA_TILE 16
+
+typedef struct nui_delta_encoder nui_delta_encoder;
+
+nui_delta_encoder *nui_make_delta_encoder(nui_extent size, nui_pixel_format format);
+void nui_free_delta_encoder(nui_delta_encoder *e);
+
+// Force the next frame to be encoded in full, eg. for a new viewer
+void nui_delta_reset(nui_delta_encoder *e);
+
+// Encode `frame` looking only at `damage` (usually `nui_layer_damage()`),
+// the first frame after creation or reset is always encoded in full.
+// Returns the encoded data, valid until the next call.
+const void *nui_delta_encode(nui_delta_encoder *e, const nui_surface *frame, const nui_rect *damage, uint32_t num_damage, size_t *p_size);
+
+// Apply a delta on top of the previous frame in `dst`, returns zero if the
+// data is malformed or doesn't match `dst`, in which case `dst` is left
+// unchanged.
+int nui_delta_decode(nui_surface *dst, const void *data, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
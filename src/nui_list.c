@@ -0,0 +1,416 @@
+#include "nui_list.h"
+
+// Variable row heights are measured one block of rows at a time when the
+// block first comes into view, unmeasured blocks count as `estimate` per
+// row. Block positions come from a Fenwick tree over the difference between
+// measured and estimated block heights so locating a row and measuring a
+// block are O(log blocks) regardless of the number of rows.
+#define NUI_LIST_BLOCK 64
+
+typedef struct nui_list_row {
+	uint32_t row;
+	int dirty;
+	nui_layer *layer;
+} nui_list_row;
+
+struct nui_list {
+	nui_canvas *canvas;
+	nui_layer *layer;
+	nui_list_desc desc;
+	nui_extent size;
+	int64_t scroll;
+
+	// Visible rows sorted by index, swapped with `next_rows` every record
+	nui_list_row *rows;
+	uint32_t num_rows, cap_rows;
+	nui_list_row *next_rows;
+	uint32_t cap_next_rows;
+
+	// Recycled row layers
+	nui_layer **pool;
+	uint32_t num_pool, cap_pool;
+
+	int64_t *block_height; // Measured height of each block or -1
+	int64_t *tree;         // 1-based Fenwick tree of measured minus estimated heights
+	uint32_t cap_block_height, cap_tree;
+	uint32_t num_blocks;
+	uint32_t block_rows;   // `desc.num_rows` the blocks were set up for
+	int heights_valid;
+	int32_t estimate;      // Row height assumed for unmeasured blocks
+	uint32_t anchor_block; // Block of the first visible row when last recorded
+};
+
+static int32_t row_height(nui_list *list, uint32_t row)
+{
+	if (list->desc.measure_row) {
+		return list->desc.measure_row(list->desc.user, row);
+	} else {
+		// Clamped like `find_row()` so recording always advances
+		return nui_max(list->desc.row_height, 1);
+	}
+}
+
+static uint32_t rows_before_block(const nui_list *list, uint32_t block)
+{
+	uint64_t rows = (uint64_t)block * NUI_LIST_BLOCK;
+	return rows < list->desc.num_rows ? (uint32_t)rows : list->desc.num_rows;
+}
+
+static int64_t block_excess(const nui_list *list, uint32_t block)
+{
+	int64_t height = list->block_height[block];
+	if (height < 0) return 0;
+	uint32_t rows = rows_before_block(list, block + 1) - rows_before_block(list, block);
+	return height - (int64_t)rows * list->estimate;
+}
+
+static void tree_add(nui_list *list, uint32_t block, int64_t value)
+{
+	for (uint32_t i = block + 1; i <= list->num_blocks; i += i & (0u - i)) {
+		list->tree[i] += value;
+	}
+}
+
+static void rebuild_tree(nui_list *list)
+{
+	uint32_t num_blocks = list->num_blocks;
+	list->tree[0] = 0;
+	for (uint32_t i = 1; i <= num_blocks; i++) {
+		list->tree[i] = block_excess(list, i - 1);
+	}
+	for (uint32_t i = 1; i <= num_blocks; i++) {
+		uint32_t parent = i + (i & (0u - i));
+		if (parent <= num_blocks) list->tree[parent] += list->tree[i];
+	}
+}
+
+// Position of the first row of `block`, `num_blocks` for the content height
+static int64_t block_y(const nui_list *list, uint32_t block)
+{
+	int64_t y = (int64_t)rows_before_block(list, block) * list->estimate;
+	for (uint32_t i = block; i > 0; i -= i & (0u - i)) {
+		y += list->tree[i];
+	}
+	return y;
+}
+
+// Block containing `y`, `num_blocks` if past the end
+static uint32_t find_block(const nui_list *list, int64_t y)
+{
+	uint32_t num_blocks = list->num_blocks;
+	uint32_t step = 1;
+	while (step <= num_blocks / 2) step <<= 1;
+
+	uint32_t pos = 0;
+	int64_t pos_y = 0;
+	for (; step > 0; step >>= 1) {
+		uint32_t next = pos + step;
+		if (next > num_blocks) continue;
+		uint32_t rows = rows_before_block(list, next) - rows_before_block(list, pos);
+		int64_t next_y = pos_y + list->tree[next] + (int64_t)rows * list->estimate;
+		if (next_y <= y) {
+			pos = next;
+			pos_y = next_y;
+		}
+	}
+	return pos;
+}
+
+// Returns nonzero if the block wasn't measured before. Blocks above the
+// one shown at the top keep the visible rows in place by moving the scroll
+// position along with them.
+static int measure_block(nui_list *list, uint32_t block)
+{
+	if (list->block_height[block] >= 0) return 0;
+
+	uint32_t begin = rows_before_block(list, block), end = rows_before_block(list, block + 1);
+	int64_t height = 0;
+	for (uint32_t row = begin; row < end; row++) {
+		height += row_height(list, row);
+	}
+	if (list->estimate <= 0) {
+		list->estimate = (int32_t)nui_max((int32_t)(height / (int64_t)(end - begin)), 1);
+	}
+
+	list->block_height[block] = height;
+	int64_t excess = block_excess(list, block);
+	tree_add(list, block, excess);
+	if (block < list->anchor_block && list->scroll > 0) {
+		list->scroll += excess;
+	}
+	return 1;
+}
+
+static void update_blocks(nui_list *list)
+{
+	uint32_t num_rows = list->desc.num_rows;
+	if (list->heights_valid && list->block_rows == num_rows) return;
+
+	uint32_t num_blocks = (num_rows + NUI_LIST_BLOCK - 1) / NUI_LIST_BLOCK;
+	nui_buf_grow_uninit(&list->block_height, &list->cap_block_height, num_blocks);
+	nui_buf_grow_uninit(&list->tree, &list->cap_tree, num_blocks + 1);
+
+	// Blocks past the old or new last row changed their row count
+	uint32_t first_stale = 0;
+	if (list->heights_valid) {
+		first_stale = nui_min(list->block_rows, num_rows) / NUI_LIST_BLOCK;
+	}
+	for (uint32_t i = first_stale; i < num_blocks; i++) {
+		list->block_height[i] = -1;
+	}
+
+	list->num_blocks = num_blocks;
+	list->block_rows = num_rows;
+	list->heights_valid = 1;
+	if (list->anchor_block > num_blocks) list->anchor_block = num_blocks;
+
+	if (list->estimate <= 0) {
+		list->estimate = list->desc.row_height;
+	}
+	rebuild_tree(list);
+
+	// Without a hint the first block is measured for the estimate
+	if (list->estimate <= 0 && num_blocks > 0) {
+		measure_block(list, 0);
+	}
+}
+
+// Find the row containing `y`, returns `num_rows` if past the end
+static uint32_t find_row(nui_list *list, int64_t y, int64_t *p_row_y)
+{
+	uint32_t num_rows = list->desc.num_rows;
+	if (y < 0) y = 0;
+
+	if (!list->desc.measure_row) {
+		int64_t h = row_height(list, 0);
+		int64_t row = y / h;
+		if (row > num_rows) row = num_rows;
+		*p_row_y = row * h;
+		return (uint32_t)row;
+	}
+
+	update_blocks(list);
+
+	// Measuring the block moves the ones after it, so search again
+	uint32_t block;
+	do {
+		block = find_block(list, y);
+		if (block >= list->num_blocks) {
+			*p_row_y = block_y(list, list->num_blocks);
+			return num_rows;
+		}
+	} while (measure_block(list, block));
+
+	uint32_t row = rows_before_block(list, block);
+	int64_t row_y = block_y(list, block);
+	for (; row < num_rows; row++) {
+		int32_t h = row_height(list, row);
+		if (y < row_y + h) break;
+		row_y += h;
+	}
+	*p_row_y = row_y;
+	return row;
+}
+
+// Measure the blocks overlapping `top` to `bottom`, returns nonzero if any
+// weren't measured yet
+static int measure_range(nui_list *list, int64_t top, int64_t bottom)
+{
+	int measured = 0;
+	uint32_t block = find_block(list, top < 0 ? 0 : top);
+	for (; block < list->num_blocks && block_y(list, block) < bottom; block++) {
+		measured |= measure_block(list, block);
+	}
+	return measured;
+}
+
+static nui_layer *alloc_row_layer(nui_list *list, nui_extent size)
+{
+	if (list->num_pool > 0) {
+		nui_layer *l = list->pool[--list->num_pool];
+		nui_resize_layer(l, size);
+		return l;
+	}
+	return nui_make_layer(list->canvas, size);
+}
+
+static void release_row_layer(nui_list *list, nui_layer *l)
+{
+	nui_clear(l);
+	nui_buf_grow(&list->pool, &list->cap_pool, list->num_pool + 1);
+	list->pool[list->num_pool++] = l;
+}
+
+static void release_all_rows(nui_list *list)
+{
+	nui_clear(list->layer);
+	for (uint32_t i = 0; i < list->num_rows; i++) {
+		release_row_layer(list, list->rows[i].layer);
+	}
+	list->num_rows = 0;
+}
+
+nui_list *nui_make_list(nui_canvas *c, nui_extent size, const nui_list_desc *desc)
+{
+	nui_assert(desc->measure_row || desc->row_height > 0);
+	nui_list *list = nui_make(nui_list);
+	list->canvas = c;
+	list->layer = nui_make_layer(c, size);
+	list->desc = *desc;
+	list->size = size;
+	return list;
+}
+
+void nui_free_list(nui_list *list)
+{
+	if (list == NULL) return;
+
+	release_all_rows(list);
+	for (uint32_t i = 0; i < list->num_pool; i++) {
+		nui_free_layer(list->pool[i]);
+	}
+	nui_free_layer(list->layer);
+
+	nui_free(list->rows);
+	nui_free(list->next_rows);
+	nui_free(list->pool);
+	nui_free(list->block_height);
+	nui_free(list->tree);
+	nui_free(list);
+}
+
+nui_layer *nui_list_layer(const nui_list *list)
+{
+	return list->layer;
+}
+
+void nui_list_resize(nui_list *list, nui_extent size)
+{
+	if (size.x == list->size.x && size.y == list->size.y) return;
+
+	// Rows are resized when recorded, changing the width re-records them
+	if (size.x != list->size.x) {
+		for (uint32_t i = 0; i < list->num_rows; i++) {
+			list->rows[i].dirty = 1;
+		}
+	}
+
+	list->size = size;
+	nui_resize_layer(list->layer, size);
+}
+
+void nui_list_set_num_rows(nui_list *list, uint32_t num_rows)
+{
+	if (num_rows == list->desc.num_rows) return;
+	list->desc.num_rows = num_rows;
+}
+
+void nui_list_scroll_to(nui_list *list, int64_t y)
+{
+	list->scroll = y;
+}
+
+int64_t nui_list_scroll(const nui_list *list)
+{
+	return list->scroll;
+}
+
+int64_t nui_list_content_height(nui_list *list)
+{
+	if (!list->desc.measure_row) {
+		return (int64_t)list->desc.num_rows * row_height(list, 0);
+	}
+
+	update_blocks(list);
+	return block_y(list, list->num_blocks);
+}
+
+void nui_list_invalidate_row(nui_list *list, uint32_t row)
+{
+	for (uint32_t i = 0; i < list->num_rows; i++) {
+		if (list->rows[i].row == row) {
+			list->rows[i].dirty = 1;
+			break;
+		}
+	}
+}
+
+void nui_list_invalidate_heights(nui_list *list)
+{
+	list->heights_valid = 0;
+	for (uint32_t i = 0; i < list->num_rows; i++) {
+		list->rows[i].dirty = 1;
+	}
+}
+
+void nui_list_record(nui_list *list)
+{
+	int64_t top, bottom, row_y;
+	uint32_t row;
+	for (;;) {
+		top = list->scroll;
+		bottom = top + list->size.y;
+		row = find_row(list, top, &row_y);
+		if (!list->desc.measure_row) break;
+
+		// Measuring the blocks coming into view may move the scroll
+		// position and what is visible, repeat until nothing changes
+		if (!measure_range(list, top, bottom) && list->scroll == top) break;
+	}
+	uint32_t num_rows = list->desc.num_rows;
+	if (list->desc.measure_row) {
+		list->anchor_block = row / NUI_LIST_BLOCK;
+	}
+
+	nui_clear(list->layer);
+
+	// Walk the visible rows while merging with the previous (sorted) set so
+	// rows that stay on screen keep their recorded layers.
+	uint32_t old_ix = 0, num_next = 0;
+	for (; row < num_rows && row_y < bottom; row++) {
+		int32_t height = row_height(list, row);
+		nui_extent size = nui_ex(list->size.x, height);
+
+		while (old_ix < list->num_rows && list->rows[old_ix].row < row) {
+			release_row_layer(list, list->rows[old_ix++].layer);
+		}
+
+		nui_list_row r;
+		if (old_ix < list->num_rows && list->rows[old_ix].row == row) {
+			r = list->rows[old_ix++];
+			nui_extent old_size = nui_layer_size(r.layer);
+			if (old_size.x != size.x || old_size.y != size.y) {
+				nui_resize_layer(r.layer, size);
+				r.dirty = 1;
+			}
+		} else {
+			r.row = row;
+			r.layer = alloc_row_layer(list, size);
+			r.dirty = 1;
+		}
+
+		if (r.dirty) {
+			nui_clear(r.layer);
+			list->desc.record_row(list->desc.user, r.layer, row);
+			r.dirty = 0;
+		}
+
+		nui_draw_layer(list->layer, nui_pt(0, (int32_t)(row_y - top)), r.layer);
+
+		nui_buf_grow(&list->next_rows, &list->cap_next_rows, num_next + 1);
+		list->next_rows[num_next++] = r;
+		row_y += height;
+	}
+
+	for (; old_ix < list->num_rows; old_ix++) {
+		release_row_layer(list, list->rows[old_ix].layer);
+	}
+
+	nui_list_row *rows = list->rows;
+	uint32_t cap_rows = list->cap_rows;
+	list->rows = list->next_rows;
+	list->cap_rows = list->cap_next_rows;
+	list->num_rows = num_next;
+	list->next_rows = rows;
+	list->cap_next_rows = cap_rows;
+}
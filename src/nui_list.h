@@ -0,0 +1,50 @@
+#pragma once
+
+#include "nui_canvas.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct nui_list nui_list;
+
+// Record the contents of `row` into `layer`, the layer has already been
+// cleared and sized to the list width and row height.
+typedef void nui_list_record_fn(void *user, nui_layer *layer, uint32_t row);
+typedef int32_t nui_list_measure_fn(void *user, uint32_t row);
+
+typedef struct nui_list_desc {
+	uint32_t num_rows;
+	int32_t row_height;               // Height of every row, must be positive, or the estimate for unmeasured rows with `measure_row`
+	nui_list_measure_fn *measure_row; // Optional variable row heights, queried as rows come into view
+	nui_list_record_fn *record_row;
+	void *user;
+} nui_list_desc;
+
+nui_list *nui_make_list(nui_canvas *c, nui_extent size, const nui_list_desc *desc);
+void nui_free_list(nui_list *list);
+
+// Layer containing the visible rows, draw this into the parent
+nui_layer *nui_list_layer(const nui_list *list);
+
+void nui_list_resize(nui_list *list, nui_extent size);
+void nui_list_set_num_rows(nui_list *list, uint32_t num_rows);
+void nui_list_scroll_to(nui_list *list, int64_t y);
+int64_t nui_list_scroll(const nui_list *list);
+// With `measure_row` rows not yet scrolled into view count as estimated
+// height, measuring them keeps the visible rows in place by adjusting the
+// scroll position.
+int64_t nui_list_content_height(nui_list *list);
+
+// Re-record a single row on the next `nui_list_record()`
+void nui_list_invalidate_row(nui_list *list, uint32_t row);
+// Re-query all row heights from `measure_row`
+void nui_list_invalidate_heights(nui_list *list);
+
+// Record only the rows intersecting the viewport, rows that stay visible
+// keep their layers and are not re-recorded.
+void nui_list_record(nui_list *list);
+
+#ifdef __cplusplus
+}
+#endif
@@ -1,5 +1,6 @@
 #include "nui_renderer_gdi.h"
 #include "nui_canvas.h"
+#include "nui_trace.h"
 
 #define WIN32_LEAN_AND_MEAN
 #define NOMINMAX
@@ -13,10 +14,14 @@ typedef struct nui_gdi_renderer {
 	nui_renderer r;
 
 	HDC measure_dc;
+	uint32_t measure_font; // Selected into `measure_dc`, UINT32_MAX for none
 
 	nui_gdi_font *fonts;
 	uint32_t cap_fonts;
 
+	int *dx; // Prefix extents for `measure_prefixes()`
+	uint32_t cap_dx;
+
 } nui_gdi_renderer;
 
 static COLORREF to_colorref(nui_color col) {
@@ -72,6 +77,11 @@ static void nui_gdi_make_font(nui_renderer *nr, uint32_t font, const nui_font_de
 	nui_buf_grow(&r->fonts, &r->cap_fonts, font + 1);
 	nui_gdi_font *f = &r->fonts[font];
 	if (f->font != NULL) {
+		// Selected fonts can't be deleted
+		if (r->measure_font == font) {
+			SelectObject(r->measure_dc, GetStockObject(SYSTEM_FONT));
+			r->measure_font = UINT32_MAX;
+		}
 		DeleteObject(f->font);
 	}
 
@@ -89,6 +99,13 @@ static void nui_gdi_make_font(nui_renderer *nr, uint32_t font, const nui_font_de
 	free_wchar(wlocal, wfamily);
 }
 
+static void select_measure_font(nui_gdi_renderer *r, uint32_t font)
+{
+	if (r->measure_font == font) return;
+	SelectObject(r->measure_dc, r->fonts[font].font);
+	r->measure_font = font;
+}
+
 static nui_extent nui_gdi_measure(nui_renderer *nr, uint32_t font, const char *str, size_t len)
 {
 	nui_gdi_renderer *r = (nui_gdi_renderer*)nr;
@@ -98,7 +115,7 @@ static nui_extent nui_gdi_measure(nui_renderer *nr, uint32_t font, const char *s
 	WCHAR *wstr = to_wchar(wlocal, nui_arraysize(wlocal), str, len, &wlen);
 
 	SIZE sz;
-	SelectObject(r->measure_dc, r->fonts[font].font);
+	select_measure_font(r, font);
 	GetTextExtentPoint32W(r->measure_dc, wstr, (int)wlen, &sz);
 
 	free_wchar(wlocal, wstr);
@@ -106,15 +123,63 @@ static nui_extent nui_gdi_measure(nui_renderer *nr, uint32_t font, const char *s
 	return nui_ex(sz.cx, sz.cy);
 }
 
+static void nui_gdi_measure_many(nui_renderer *nr, uint32_t font, const char *const *strs, const size_t *lens, uint32_t count, nui_extent *extents)
+{
+	nui_gdi_renderer *r = (nui_gdi_renderer*)nr;
+	select_measure_font(r, font);
+
+	WCHAR wlocal[512];
+	for (uint32_t i = 0; i < count; i++) {
+		DWORD wlen;
+		WCHAR *wstr = to_wchar(wlocal, nui_arraysize(wlocal), strs[i], lens[i], &wlen);
+
+		SIZE sz;
+		GetTextExtentPoint32W(r->measure_dc, wstr, (int)wlen, &sz);
+		extents[i] = nui_ex(sz.cx, sz.cy);
+
+		free_wchar(wlocal, wstr);
+	}
+}
+
+static nui_extent nui_gdi_measure_prefixes(nui_renderer *nr, uint32_t font, const char *str, size_t len, int32_t *advances)
+{
+	nui_gdi_renderer *r = (nui_gdi_renderer*)nr;
+	select_measure_font(r, font);
+
+	DWORD wlen;
+	WCHAR wlocal[512];
+	WCHAR *wstr = to_wchar(wlocal, nui_arraysize(wlocal), str, len, &wlen);
+
+	SIZE sz;
+	nui_buf_grow_uninit(&r->dx, &r->cap_dx, wlen + 1);
+	GetTextExtentExPointW(r->measure_dc, wstr, (int)wlen, 0, NULL, r->dx, &sz);
+	free_wchar(wlocal, wstr);
+
+	// Map the UTF-16 units back to bytes, codepoints past the BMP take two
+	DWORD unit = 0;
+	for (size_t i = 0; i < len; ) {
+		uint8_t b = (uint8_t)str[i];
+		size_t size = b >= 0xf0 ? 4 : b >= 0xe0 ? 3 : b >= 0xc0 ? 2 : 1;
+		if (size > len - i) size = len - i;
+		unit += size == 4 ? 2 : 1;
+		int32_t width = wlen > 0 ? r->dx[nui_min((int32_t)unit, (int32_t)wlen) - 1] : 0;
+		for (size_t end = i + size; i < end; i++) advances[i] = width;
+	}
+
+	return nui_ex(sz.cx, sz.cy);
+}
+
 static void nui_gdi_free(nui_renderer *nr)
 {
 	nui_gdi_renderer *r = (nui_gdi_renderer*)nr;
+	SelectObject(r->measure_dc, GetStockObject(SYSTEM_FONT));
 	for (uint32_t i = 0; i < r->cap_fonts; i++) {
 		nui_gdi_font *f = &r->fonts[i];
 		if (f->font != NULL) {
 			DeleteObject(f->font);
 		}
 	}
+	nui_free(r->dx);
 	nui_free(r);
 }
 
@@ -124,14 +189,19 @@ nui_renderer *nui_gdi_renderer_make(void *dc)
 	r->r.make_font = &nui_gdi_make_font;
 	r->r.measure = &nui_gdi_measure;
 	r->r.free = &nui_gdi_free;
+	r->r.measure_many = &nui_gdi_measure_many;
+	r->r.measure_prefixes = &nui_gdi_measure_prefixes;
 
 	r->measure_dc = CreateCompatibleDC((HDC)dc);
+	r->measure_font = UINT32_MAX;
 
 	return &r->r;
 }
 
 static void render(nui_gdi_renderer *r, HDC dc, const nui_render_info *ri, int redraw)
 {
+	nui_trace_begin(layer);
+
 	nui_draw *ptr = nui_draws_begin(ri->layer);
 	nui_draw *end = nui_draws_end(ri->layer);
 
@@ -150,8 +220,35 @@ static void render(nui_gdi_renderer *r, HDC dc, const nui_render_info *ri, int r
 		DeleteObject(brush);
 	}
 
+	// Clip draws narrow both the culling rect and the DC clip region
+	nui_rect clip = ri->clip;
+	nui_rect clip_stack[NUI_MAX_CLIP_DEPTH];
+	uint32_t clip_depth = 0;
+
 	for (; ptr != end; ptr = nui_next_draw(ptr)) {
-		if (!nui_intersects(&ptr->bounds, &ri->clip)) continue;
+		if (ptr->type == nui_dt_clip_push) {
+			if (!nui_intersects(&ptr->bounds, &clip)) {
+				ptr = nui_clip_end(ptr);
+				continue;
+			}
+			clip_stack[clip_depth++] = clip;
+			clip.left = nui_max(clip.left, ptr->bounds.left);
+			clip.top = nui_max(clip.top, ptr->bounds.top);
+			clip.right = nui_min(clip.right, ptr->bounds.right);
+			clip.bottom = nui_min(clip.bottom, ptr->bounds.bottom);
+
+			RECT rc = to_rect(ptr->bounds, ri->offset);
+			SaveDC(dc);
+			IntersectClipRect(dc, rc.left, rc.top, rc.right, rc.bottom);
+			continue;
+		}
+		if (ptr->type == nui_dt_clip_pop) {
+			clip = clip_stack[--clip_depth];
+			RestoreDC(dc, -1);
+			continue;
+		}
+
+		if (!nui_intersects(&ptr->bounds, &clip)) continue;
 
 		switch (ptr->type) {
 
@@ -187,15 +284,18 @@ static void render(nui_gdi_renderer *r, HDC dc, const nui_render_info *ri, int r
 			lri.layer = draw->layer;
 			lri.offset.x = ri->offset.x + p.x;
 			lri.offset.y = ri->offset.y + p.y;
-			lri.clip.min.x = nui_max(ri->clip.min.x - p.x, 0);
-			lri.clip.min.y = nui_max(ri->clip.min.y - p.y, 0);
-			lri.clip.max.x = nui_min(ri->clip.max.x - p.x, size.x);
-			lri.clip.max.y = nui_min(ri->clip.max.y - p.y, size.y);
+			lri.clip.min.x = nui_max(clip.min.x - p.x, 0);
+			lri.clip.min.y = nui_max(clip.min.y - p.y, 0);
+			lri.clip.max.x = nui_min(clip.max.x - p.x, size.x);
+			lri.clip.max.y = nui_min(clip.max.y - p.y, size.y);
 			render(r, dc, &lri, redraw);
 		} break;
 
+		default: break;
 		}
 	}
+
+	nui_trace_end_arg(layer, "render_layer", "layer", nui_layer_index(ri->layer));
 }
 
 void nui_gdi_render(void *dc, const nui_render_info *ri)
@@ -203,5 +303,7 @@ void nui_gdi_render(void *dc, const nui_render_info *ri)
 	HDC hdc = (HDC)dc;
 	nui_gdi_renderer *r = (nui_gdi_renderer*)nui_layer_renderer(ri->layer);
 	SetBkMode(hdc, TRANSPARENT);
+	nui_trace_begin(render);
 	render(r, hdc, ri, 0);
+	nui_trace_end(render, "gdi_render");
 }
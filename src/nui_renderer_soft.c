@@ -0,0 +1,1890 @@
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+	#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include "nui_renderer_soft.h"
+#include "nui_canvas.h"
+#include "nui_trace.h"
+#include <math.h>
+#include <string.h>
+#include <stdio.h>
+
+#if defined(_WIN32)
+	#define WIN32_LEAN_AND_MEAN
+	#define NOMINMAX
+	#include <Windows.h>
+	#include <io.h>
+#else
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <fcntl.h>
+	#include <unistd.h>
+#endif
+
+#if NUI_SSE2
+	#include <emmintrin.h>
+#endif
+
+// Pixel formats
+//
+// Every format defines a storage type `nui_px_<fmt>` with `pack_<fmt>()` and
+// `unpack_<fmt>()`. The span routines below are generated per format and
+// blend mode from these so each combination compiles to its own loop and
+// the format is only dispatched once per span.
+
+typedef uint32_t nui_px_bgra8;
+typedef uint32_t nui_px_rgba8;
+typedef uint16_t nui_px_rgb565;
+typedef uint8_t nui_px_a8;
+
+static nui_px_bgra8 pack_bgra8(nui_color c) {
+	return (uint32_t)c.b | (uint32_t)c.g << 8 | (uint32_t)c.r << 16 | (uint32_t)c.a << 24;
+}
+
+static nui_color unpack_bgra8(nui_px_bgra8 p) {
+	nui_color c;
+	c.b = (uint8_t)p; c.g = (uint8_t)(p >> 8); c.r = (uint8_t)(p >> 16); c.a = (uint8_t)(p >> 24);
+	return c;
+}
+
+static nui_px_rgba8 pack_rgba8(nui_color c) {
+	return (uint32_t)c.r | (uint32_t)c.g << 8 | (uint32_t)c.b << 16 | (uint32_t)c.a << 24;
+}
+
+static nui_color unpack_rgba8(nui_px_rgba8 p) {
+	nui_color c;
+	c.r = (uint8_t)p; c.g = (uint8_t)(p >> 8); c.b = (uint8_t)(p >> 16); c.a = (uint8_t)(p >> 24);
+	return c;
+}
+
+static nui_px_rgb565 pack_rgb565(nui_color c) {
+	return (uint16_t)((c.r >> 3) << 11 | (c.g >> 2) << 5 | (c.b >> 3));
+}
+
+static nui_color unpack_rgb565(nui_px_rgb565 p) {
+	uint32_t r = p >> 11, g = p >> 5 & 0x3f, b = p & 0x1f;
+	nui_color c;
+	c.r = (uint8_t)(r << 3 | r >> 2); c.g = (uint8_t)(g << 2 | g >> 4); c.b = (uint8_t)(b << 3 | b >> 2); c.a = 0xff;
+	return c;
+}
+
+static nui_px_a8 pack_a8(nui_color c) {
+	return c.a;
+}
+
+static nui_color unpack_a8(nui_px_a8 p) {
+	nui_color c;
+	c.r = c.g = c.b = 0; c.a = p;
+	return c;
+}
+
+// Blending
+
+static uint32_t div255(uint32_t x) {
+	x += 128;
+	return (x + (x >> 8)) >> 8;
+}
+
+// `src` over `dst` with coverage `a` (already multiplied with `src.a`)
+static nui_color blend_gamma(nui_color dst, nui_color src, uint32_t a) {
+	uint32_t ia = 255 - a;
+	nui_color c;
+	c.r = (uint8_t)div255(src.r * a + dst.r * ia);
+	c.g = (uint8_t)div255(src.g * a + dst.g * ia);
+	c.b = (uint8_t)div255(src.b * a + dst.b * ia);
+	c.a = (uint8_t)(a + div255(dst.a * ia));
+	return c;
+}
+
+// Linear-light blending, sRGB channels are converted to 12 bit linear
+// values, mixed and converted back. Alpha and coverage are linear already.
+
+#define NUI_LINEAR_BITS 12
+#define NUI_LINEAR_MAX ((1u << NUI_LINEAR_BITS) - 1)
+
+static uint16_t g_srgb_to_linear[256];
+static uint8_t g_linear_to_srgb[NUI_LINEAR_MAX + 1];
+static volatile uint64_t g_linear_tables_init; // 0 none, 1 building, 2 ready
+
+static double srgb_decode(double v) {
+	return v <= 0.04045 ? v / 12.92 : pow((v + 0.055) / 1.055, 2.4);
+}
+
+static double srgb_encode(double v) {
+	return v <= 0.0031308 ? v * 12.92 : 1.055 * pow(v, 1.0 / 2.4) - 0.055;
+}
+
+// Built once by whichever renderer turns linear blending on first, others
+// wait until the tables are complete
+static void init_linear_tables(void) {
+	if (nui_atomic_load64(&g_linear_tables_init) == 2) return;
+	if (nui_atomic_cas64(&g_linear_tables_init, 0, 1) != 0) {
+		while (nui_atomic_load64(&g_linear_tables_init) != 2) { }
+		return;
+	}
+	for (uint32_t i = 0; i < 256; i++) {
+		g_srgb_to_linear[i] = (uint16_t)(srgb_decode(i / 255.0) * NUI_LINEAR_MAX + 0.5);
+	}
+	for (uint32_t i = 0; i <= NUI_LINEAR_MAX; i++) {
+		g_linear_to_srgb[i] = (uint8_t)(srgb_encode((double)i / NUI_LINEAR_MAX) * 255.0 + 0.5);
+	}
+	nui_atomic_store64(&g_linear_tables_init, 2);
+}
+
+static uint32_t mix_linear(uint32_t dst, uint32_t src, uint32_t a, uint32_t ia) {
+	return g_linear_to_srgb[(g_srgb_to_linear[src] * a + g_srgb_to_linear[dst] * ia + 127) / 255];
+}
+
+static nui_color blend_linear(nui_color dst, nui_color src, uint32_t a) {
+	uint32_t ia = 255 - a;
+	nui_color c;
+	c.r = (uint8_t)mix_linear(dst.r, src.r, a, ia);
+	c.g = (uint8_t)mix_linear(dst.g, src.g, a, ia);
+	c.b = (uint8_t)mix_linear(dst.b, src.b, a, ia);
+	c.a = (uint8_t)(a + div255(dst.a * ia));
+	return c;
+}
+
+// Premultiplied `nui_pf_bgra8` back to straight alpha
+static uint32_t unpremultiply(uint32_t px) {
+	uint32_t a = px >> 24;
+	if (a == 255) return px;
+	if (a == 0) return 0;
+	uint32_t res = px & 0xff000000u;
+	for (uint32_t shift = 0; shift < 24; shift += 8) {
+		uint32_t c = (px >> shift) & 0xff;
+		res |= (uint32_t)nui_min((int32_t)((c * 255 + a / 2) / a), 255) << shift;
+	}
+	return res;
+}
+
+// Vectorized gamma-space blending of 32-bit pixels, four at a time. The
+// channel order doesn't matter as `src` is packed to the destination format
+// with alpha forced to 255, blending the alpha byte like a color channel
+// then yields `a + dst.a * (1 - a)` which matches `blend_gamma()` exactly.
+// Return the number of pixels done, the caller finishes the tail.
+
+#if NUI_SSE2
+
+static __m128i div255_sse2(__m128i x) {
+	x = _mm_add_epi16(x, _mm_set1_epi16(128));
+	return _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
+}
+
+// `s_a` is the unpacked source premultiplied by `a`, `ia` the inverse alpha
+static __m128i blend_sse2(__m128i d, __m128i s_a, __m128i ia) {
+	return div255_sse2(_mm_add_epi16(_mm_mullo_epi16(d, ia), s_a));
+}
+
+static int32_t fill_over_simd(uint32_t *d, int32_t count, uint32_t src, uint32_t a) {
+	__m128i zero = _mm_setzero_si128();
+	__m128i s = _mm_unpacklo_epi8(_mm_set1_epi32((int)src), zero);
+	__m128i s_a = _mm_mullo_epi16(s, _mm_set1_epi16((short)a));
+	__m128i ia = _mm_set1_epi16((short)(255 - a));
+	int32_t i = 0;
+	for (; i + 4 <= count; i += 4) {
+		__m128i px = _mm_loadu_si128((const __m128i*)(d + i));
+		__m128i lo = blend_sse2(_mm_unpacklo_epi8(px, zero), s_a, ia);
+		__m128i hi = blend_sse2(_mm_unpackhi_epi8(px, zero), s_a, ia);
+		_mm_storeu_si128((__m128i*)(d + i), _mm_packus_epi16(lo, hi));
+	}
+	return i;
+}
+
+static int32_t mask_simd(uint32_t *d, const uint8_t *coverage, int32_t count, uint32_t src, uint32_t alpha) {
+	__m128i zero = _mm_setzero_si128();
+	__m128i s = _mm_unpacklo_epi8(_mm_set1_epi32((int)src), zero);
+	__m128i va = _mm_set1_epi16((short)alpha);
+	__m128i v255 = _mm_set1_epi16(255);
+	int32_t i = 0;
+	for (; i + 4 <= count; i += 4) {
+		uint32_t cov;
+		memcpy(&cov, coverage + i, 4);
+		if (cov == 0) continue;
+		if (cov == UINT32_MAX && alpha == 255) {
+			__m128i px = _mm_set1_epi32((int)src);
+			_mm_storeu_si128((__m128i*)(d + i), px);
+			continue;
+		}
+
+		// Per pixel alpha broadcast to the four channels of each pixel
+		__m128i a = div255_sse2(_mm_mullo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128((int)cov), zero), va));
+		a = _mm_unpacklo_epi16(a, a);
+		__m128i a_lo = _mm_unpacklo_epi32(a, a), a_hi = _mm_unpackhi_epi32(a, a);
+
+		__m128i px = _mm_loadu_si128((const __m128i*)(d + i));
+		__m128i lo = blend_sse2(_mm_unpacklo_epi8(px, zero), _mm_mullo_epi16(s, a_lo), _mm_sub_epi16(v255, a_lo));
+		__m128i hi = blend_sse2(_mm_unpackhi_epi8(px, zero), _mm_mullo_epi16(s, a_hi), _mm_sub_epi16(v255, a_hi));
+		_mm_storeu_si128((__m128i*)(d + i), _mm_packus_epi16(lo, hi));
+	}
+	return i;
+}
+
+// `src` is `nui_pf_bgra8`, `swap` exchanges red and blue for `nui_pf_rgba8`
+static int32_t blit_over_simd(uint32_t *d, const uint32_t *src, int32_t count, int swap) {
+	__m128i zero = _mm_setzero_si128();
+	__m128i v255 = _mm_set1_epi16(255);
+	__m128i alpha_mask = _mm_set_epi16(255, 0, 0, 0, 255, 0, 0, 0);
+	__m128i alpha_bytes = _mm_set1_epi32((int)0xff000000u);
+	int32_t i = 0;
+	for (; i + 4 <= count; i += 4) {
+		__m128i s = _mm_loadu_si128((const __m128i*)(src + i));
+		__m128i sa = _mm_and_si128(s, alpha_bytes);
+		if (_mm_movemask_epi8(_mm_cmpeq_epi32(sa, zero)) == 0xffff) continue;
+
+		__m128i s_lo = _mm_unpacklo_epi8(s, zero), s_hi = _mm_unpackhi_epi8(s, zero);
+		if (swap) {
+			s_lo = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s_lo, _MM_SHUFFLE(3, 0, 1, 2)), _MM_SHUFFLE(3, 0, 1, 2));
+			s_hi = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s_hi, _MM_SHUFFLE(3, 0, 1, 2)), _MM_SHUFFLE(3, 0, 1, 2));
+		}
+		if (_mm_movemask_epi8(_mm_cmpeq_epi32(sa, alpha_bytes)) == 0xffff) {
+			_mm_storeu_si128((__m128i*)(d + i), _mm_packus_epi16(s_lo, s_hi));
+			continue;
+		}
+
+		__m128i a_lo = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s_lo, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+		__m128i a_hi = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s_hi, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+		s_lo = _mm_or_si128(s_lo, alpha_mask);
+		s_hi = _mm_or_si128(s_hi, alpha_mask);
+
+		__m128i px = _mm_loadu_si128((const __m128i*)(d + i));
+		__m128i lo = blend_sse2(_mm_unpacklo_epi8(px, zero), _mm_mullo_epi16(s_lo, a_lo), _mm_sub_epi16(v255, a_lo));
+		__m128i hi = blend_sse2(_mm_unpackhi_epi8(px, zero), _mm_mullo_epi16(s_hi, a_hi), _mm_sub_epi16(v255, a_hi));
+		_mm_storeu_si128((__m128i*)(d + i), _mm_packus_epi16(lo, hi));
+	}
+	return i;
+}
+
+// Premultiply unpacked pixels, alpha lanes are scaled by 255 to stay as is
+static __m128i premultiply_sse2(__m128i p) {
+	__m128i alpha_lanes = _mm_set_epi16(-1, 0, 0, 0, -1, 0, 0, 0);
+	__m128i a = _mm_shufflehi_epi16(_mm_shufflelo_epi16(p, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+	a = _mm_or_si128(_mm_andnot_si128(alpha_lanes, a), _mm_and_si128(alpha_lanes, _mm_set1_epi16(255)));
+	return div255_sse2(_mm_mullo_epi16(p, a));
+}
+
+// Match `bilinear_h()` and `bilinear_v()`. The horizontal pass does two
+// pixels at a time with the texel pairs weighted in the low and high halves.
+static int32_t bilinear_h_simd(uint16_t *d, const uint32_t *row, const uint32_t *cols, const uint8_t *weights, int32_t count) {
+	__m128i zero = _mm_setzero_si128();
+	__m128i round = _mm_set1_epi16(128);
+	int32_t i = 0;
+	for (; i + 2 <= count; i += 2) {
+		uint32_t x0 = cols[i], w0 = weights[i], x1 = cols[i + 1], w1 = weights[i + 1];
+		__m128i p0 = _mm_unpacklo_epi32(_mm_cvtsi32_si128((int)row[x0]), _mm_cvtsi32_si128((int)row[x0 + (w0 != 0)]));
+		__m128i p1 = _mm_unpacklo_epi32(_mm_cvtsi32_si128((int)row[x1]), _mm_cvtsi32_si128((int)row[x1 + (w1 != 0)]));
+		__m128i wv0 = _mm_unpacklo_epi64(_mm_set1_epi16((short)(256 - w0)), _mm_set1_epi16((short)w0));
+		__m128i wv1 = _mm_unpacklo_epi64(_mm_set1_epi16((short)(256 - w1)), _mm_set1_epi16((short)w1));
+		p0 = _mm_mullo_epi16(premultiply_sse2(_mm_unpacklo_epi8(p0, zero)), wv0);
+		p1 = _mm_mullo_epi16(premultiply_sse2(_mm_unpacklo_epi8(p1, zero)), wv1);
+		__m128i sum = _mm_add_epi16(_mm_unpacklo_epi64(p0, p1), _mm_unpackhi_epi64(p0, p1));
+		_mm_storeu_si128((__m128i*)(d + i * 4), _mm_srli_epi16(_mm_add_epi16(sum, round), 8));
+	}
+	return i;
+}
+
+static int32_t bilinear_v_simd(uint32_t *d, const uint16_t *h0, const uint16_t *h1, int32_t count, uint32_t wy) {
+	__m128i round = _mm_set1_epi16(128);
+	__m128i vwy = _mm_set1_epi16((short)wy), viwy = _mm_set1_epi16((short)(256 - wy));
+	__m128i alpha_bytes = _mm_set1_epi32((int)0xff000000u);
+	int32_t i = 0;
+	for (; i + 4 <= count; i += 4) {
+		__m128i v[2];
+		for (int k = 0; k < 2; k++) {
+			__m128i t = _mm_loadu_si128((const __m128i*)(h0 + i * 4 + k * 8));
+			__m128i b = _mm_loadu_si128((const __m128i*)(h1 + i * 4 + k * 8));
+			__m128i x = _mm_add_epi16(_mm_mullo_epi16(t, viwy), _mm_mullo_epi16(b, vwy));
+			v[k] = _mm_srli_epi16(_mm_add_epi16(x, round), 8);
+		}
+		__m128i px = _mm_packus_epi16(v[0], v[1]);
+		_mm_storeu_si128((__m128i*)(d + i), px);
+		if (_mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(px, alpha_bytes), alpha_bytes)) == 0xffff) continue;
+		for (int32_t k = i; k < i + 4; k++) d[k] = unpremultiply(d[k]);
+	}
+	return i;
+}
+
+#else
+
+static int32_t fill_over_simd(uint32_t *d, int32_t count, uint32_t src, uint32_t a) {
+	(void)d; (void)count; (void)src; (void)a;
+	return 0;
+}
+
+static int32_t mask_simd(uint32_t *d, const uint8_t *coverage, int32_t count, uint32_t src, uint32_t alpha) {
+	(void)d; (void)coverage; (void)count; (void)src; (void)alpha;
+	return 0;
+}
+
+static int32_t blit_over_simd(uint32_t *d, const uint32_t *src, int32_t count, int swap) {
+	(void)d; (void)src; (void)count; (void)swap;
+	return 0;
+}
+
+static int32_t bilinear_h_simd(uint16_t *d, const uint32_t *row, const uint32_t *cols, const uint8_t *weights, int32_t count) {
+	(void)d; (void)row; (void)cols; (void)weights; (void)count;
+	return 0;
+}
+
+static int32_t bilinear_v_simd(uint32_t *d, const uint16_t *h0, const uint16_t *h1, int32_t count, uint32_t wy) {
+	(void)d; (void)h0; (void)h1; (void)count; (void)wy;
+	return 0;
+}
+
+#endif
+
+// Only gamma-space blending is vectorized, the linear path is bound by the
+// table lookups
+#if NUI_SSE2
+	#define NUI_SOFT_SIMD_gamma 1
+#else
+	#define NUI_SOFT_SIMD_gamma 0
+#endif
+#define NUI_SOFT_SIMD_linear 0
+
+static nui_color opaque(nui_color c) {
+	c.a = 255;
+	return c;
+}
+
+typedef enum nui_blend_mode {
+	nui_bm_copy,
+	nui_bm_over,
+
+	nui_blend_modes,
+} nui_blend_mode;
+
+// Spans, `dst` and `src` point to the first pixel, `src` is `nui_pf_bgra8`
+typedef void nui_fill_span_fn(void *dst, int32_t count, nui_color color);
+typedef void nui_mask_span_fn(void *dst, const uint8_t *coverage, int32_t count, nui_color color);
+typedef void nui_blit_span_fn(void *dst, const void *src, int32_t count);
+
+typedef struct nui_soft_pipeline {
+	nui_fill_span_fn *fill[nui_blend_modes];
+	nui_mask_span_fn *mask;
+	nui_blit_span_fn *blit[nui_blend_modes];
+} nui_soft_pipeline;
+
+// Copy spans are shared between the blend spaces
+#define NUI_SOFT_COPY(fmt) \
+	static void fill_copy_##fmt(void *dst, int32_t count, nui_color color) { \
+		nui_px_##fmt *d = (nui_px_##fmt*)dst, px = pack_##fmt(color); \
+		for (int32_t i = 0; i < count; i++) d[i] = px; \
+	} \
+	static void blit_copy_##fmt(void *dst, const void *src, int32_t count) { \
+		nui_px_##fmt *d = (nui_px_##fmt*)dst; const nui_px_bgra8 *s = (const nui_px_bgra8*)src; \
+		for (int32_t i = 0; i < count; i++) d[i] = pack_##fmt(unpack_bgra8(s[i])); \
+	}
+
+// Fully opaque pixels are stored directly without touching the destination
+#define NUI_SOFT_PIPELINE(fmt, space) \
+	static void fill_over_##fmt##_##space(void *dst, int32_t count, nui_color color) { \
+		nui_px_##fmt *d = (nui_px_##fmt*)dst; \
+		int32_t i = 0; \
+		if (sizeof(nui_px_##fmt) == 4 && NUI_SOFT_SIMD_##space) { \
+			i = fill_over_simd((uint32_t*)d, count, (uint32_t)pack_##fmt(opaque(color)), color.a); \
+		} \
+		for (; i < count; i++) d[i] = pack_##fmt(blend_##space(unpack_##fmt(d[i]), color, color.a)); \
+	} \
+	static void mask_##fmt##_##space(void *dst, const uint8_t *coverage, int32_t count, nui_color color) { \
+		nui_px_##fmt *d = (nui_px_##fmt*)dst, opaque_px = pack_##fmt(opaque(color)); \
+		int32_t i = 0; \
+		if (sizeof(nui_px_##fmt) == 4 && NUI_SOFT_SIMD_##space) { \
+			i = mask_simd((uint32_t*)d, coverage, count, (uint32_t)opaque_px, color.a); \
+		} \
+		for (; i < count; i++) { \
+			uint32_t a = div255(coverage[i] * color.a); \
+			if (a == 0) continue; \
+			d[i] = a == 255 ? opaque_px : pack_##fmt(blend_##space(unpack_##fmt(d[i]), color, a)); \
+		} \
+	} \
+	static void blit_over_##fmt##_##space(void *dst, const void *src, int32_t count) { \
+		nui_px_##fmt *d = (nui_px_##fmt*)dst; const nui_px_bgra8 *s = (const nui_px_bgra8*)src; \
+		int32_t i = 0; \
+		if (sizeof(nui_px_##fmt) == 4 && NUI_SOFT_SIMD_##space) { \
+			int swap = (uint32_t)pack_##fmt(unpack_bgra8(0x03020100u)) != 0x03020100u; \
+			i = blit_over_simd((uint32_t*)d, s, count, swap); \
+		} \
+		for (; i < count; i++) { \
+			nui_color c = unpack_bgra8(s[i]); \
+			if (c.a == 0) continue; \
+			d[i] = c.a == 255 ? pack_##fmt(c) : pack_##fmt(blend_##space(unpack_##fmt(d[i]), c, c.a)); \
+		} \
+	} \
+	static const nui_soft_pipeline pipeline_##fmt##_##space = { \
+		{ &fill_copy_##fmt, &fill_over_##fmt##_##space }, \
+		&mask_##fmt##_##space, \
+		{ &blit_copy_##fmt, &blit_over_##fmt##_##space }, \
+	};
+
+#define NUI_SOFT_FORMAT(fmt) \
+	NUI_SOFT_COPY(fmt) \
+	NUI_SOFT_PIPELINE(fmt, gamma) \
+	NUI_SOFT_PIPELINE(fmt, linear)
+
+NUI_SOFT_FORMAT(bgra8)
+NUI_SOFT_FORMAT(rgba8)
+NUI_SOFT_FORMAT(rgb565)
+NUI_SOFT_FORMAT(a8)
+
+static const nui_soft_pipeline *pipelines[2][nui_pixel_formats] = {
+	{ &pipeline_bgra8_gamma, &pipeline_rgba8_gamma, &pipeline_rgb565_gamma, &pipeline_a8_gamma },
+	{ &pipeline_bgra8_linear, &pipeline_rgba8_linear, &pipeline_rgb565_linear, &pipeline_a8_linear },
+};
+
+// Image scaling, `cols` are the source columns of each destination pixel.
+// Bilinear filtering interpolates premultiplied colors so transparent
+// texels don't bleed into their neighbours. It's done in two passes, each
+// source row is filtered horizontally once into premultiplied B, G, R, A
+// words that are then blended vertically for every destination row.
+// `weights` and `wy` are the 8 bit fractions towards the next column and row.
+
+static uint32_t lerp256(uint32_t a, uint32_t b, uint32_t w) {
+	return (a * (256 - w) + b * w + 128) >> 8;
+}
+
+static uint32_t premultiply_channel(uint32_t px, uint32_t shift) {
+	uint32_t c = (px >> shift) & 0xff;
+	return shift == 24 ? c : div255(c * (px >> 24));
+}
+
+static void nearest_span(uint32_t *d, const uint32_t *row, const uint32_t *cols, int32_t count) {
+	for (int32_t i = 0; i < count; i++) d[i] = row[cols[i]];
+}
+
+static void bilinear_h(uint16_t *d, const uint32_t *row, const uint32_t *cols, const uint8_t *weights, int32_t count) {
+	int32_t i = bilinear_h_simd(d, row, cols, weights, count);
+	for (; i < count; i++) {
+		uint32_t x = cols[i], wx = weights[i], x1 = x + (wx != 0);
+		for (uint32_t c = 0; c < 4; c++) {
+			d[i * 4 + c] = (uint16_t)lerp256(premultiply_channel(row[x], c * 8), premultiply_channel(row[x1], c * 8), wx);
+		}
+	}
+}
+
+static void bilinear_v(uint32_t *d, const uint16_t *h0, const uint16_t *h1, int32_t count, uint32_t wy) {
+	int32_t i = bilinear_v_simd(d, h0, h1, count, wy);
+	for (; i < count; i++) {
+		uint32_t px = 0;
+		for (uint32_t c = 0; c < 4; c++) {
+			px |= lerp256(h0[i * 4 + c], h1[i * 4 + c], wy) << (c * 8);
+		}
+		d[i] = unpremultiply(px);
+	}
+}
+
+// Conversion
+
+typedef void nui_convert_span_fn(void *dst, const void *src, int32_t count);
+
+#define NUI_SOFT_CONVERT(dfmt, sfmt) \
+	static void convert_##dfmt##_##sfmt(void *dst, const void *src, int32_t count) { \
+		nui_px_##dfmt *d = (nui_px_##dfmt*)dst; const nui_px_##sfmt *s = (const nui_px_##sfmt*)src; \
+		for (int32_t i = 0; i < count; i++) d[i] = pack_##dfmt(unpack_##sfmt(s[i])); \
+	}
+
+#define NUI_SOFT_CONVERT_FROM(sfmt) \
+	NUI_SOFT_CONVERT(bgra8, sfmt) \
+	NUI_SOFT_CONVERT(rgba8, sfmt) \
+	NUI_SOFT_CONVERT(rgb565, sfmt) \
+	NUI_SOFT_CONVERT(a8, sfmt)
+
+NUI_SOFT_CONVERT_FROM(bgra8)
+NUI_SOFT_CONVERT_FROM(rgba8)
+NUI_SOFT_CONVERT_FROM(rgb565)
+NUI_SOFT_CONVERT_FROM(a8)
+
+#define NUI_SOFT_CONVERT_ROW(dfmt) \
+	{ &convert_##dfmt##_bgra8, &convert_##dfmt##_rgba8, &convert_##dfmt##_rgb565, &convert_##dfmt##_a8 }
+
+static nui_convert_span_fn *const converters[nui_pixel_formats][nui_pixel_formats] = {
+	NUI_SOFT_CONVERT_ROW(bgra8),
+	NUI_SOFT_CONVERT_ROW(rgba8),
+	NUI_SOFT_CONVERT_ROW(rgb565),
+	NUI_SOFT_CONVERT_ROW(a8),
+};
+
+uint32_t nui_pixel_size(nui_pixel_format format)
+{
+	switch (format) {
+	case nui_pf_bgra8: return 4;
+	case nui_pf_rgba8: return 4;
+	case nui_pf_rgb565: return 2;
+	case nui_pf_a8: return 1;
+	default: return 0;
+	}
+}
+
+static void *pixel_ptr(const nui_surface *s, int32_t x, int32_t y)
+{
+	return (char*)s->pixels + (size_t)y * s->stride + (size_t)x * nui_pixel_size(s->format);
+}
+
+static int clip_rect(nui_rect *r, const nui_rect *clip)
+{
+	r->left = nui_max(r->left, clip->left);
+	r->top = nui_max(r->top, clip->top);
+	r->right = nui_min(r->right, clip->right);
+	r->bottom = nui_min(r->bottom, clip->bottom);
+	return r->left < r->right && r->top < r->bottom;
+}
+
+void nui_soft_convert(nui_surface *dst, const nui_surface *src, const nui_rect *rect)
+{
+	nui_rect r;
+	r.left = 0;
+	r.top = 0;
+	r.right = nui_min(dst->width, src->width);
+	r.bottom = nui_min(dst->height, src->height);
+	if (rect && !clip_rect(&r, rect)) return;
+
+	int32_t count = r.right - r.left;
+	if (dst->format == src->format) {
+		size_t row_size = (size_t)count * nui_pixel_size(src->format);
+		for (int32_t y = r.top; y < r.bottom; y++) {
+			memcpy(pixel_ptr(dst, r.left, y), pixel_ptr(src, r.left, y), row_size);
+		}
+		return;
+	}
+
+	nui_convert_span_fn *convert = converters[dst->format][src->format];
+	for (int32_t y = r.top; y < r.bottom; y++) {
+		convert(pixel_ptr(dst, r.left, y), pixel_ptr(src, r.left, y), count);
+	}
+}
+
+// Renderer
+
+typedef struct nui_soft_cached_glyph {
+	uint32_t key; // Codepoint + 1, zero for empty slots
+	int32_t advance;
+	int16_t x, y;
+	uint16_t width, height;
+	uint32_t coverage; // Offset into `nui_soft_font.coverage` or the mapped coverage
+} nui_soft_cached_glyph;
+
+#define NUI_SOFT_MAPPED_COVERAGE 0x80000000u
+
+typedef struct nui_soft_font {
+	char *family;
+	int32_t height;
+	int32_t line_height;
+	int loaded; // `load_font()` is deferred while the glyph cache file has everything
+
+	nui_soft_cached_glyph *glyphs;
+	uint32_t num_glyphs, cap_glyphs;
+
+	uint8_t *coverage;
+	uint32_t coverage_size, coverage_cap;
+
+	// From the glyph cache file, sorted by key
+	const nui_soft_cached_glyph *mapped_glyphs;
+	uint32_t num_mapped_glyphs;
+	const uint8_t *mapped_coverage;
+	uint32_t mapped_coverage_size;
+} nui_soft_font;
+
+// Layer rendered once and copied to each of its instances, valid while
+// the content hash and the background it was rendered over match
+typedef struct nui_soft_instance {
+	char *pixels;
+	uint32_t cap_pixels;
+	nui_surface surface;
+	nui_color bg_color;
+	uint64_t content_hash;
+	int linear;
+	int valid;
+	uint32_t pass; // Last render pass the entry was (re-)rendered in
+} nui_soft_instance;
+
+typedef struct nui_soft_tile {
+	nui_rect rect; // Surface coordinates
+	uint64_t priority; // Lowest first
+} nui_soft_tile;
+
+typedef struct nui_soft_renderer {
+	nui_renderer r;
+
+	nui_soft_font_source *source;
+
+	nui_soft_font *fonts;
+	uint32_t cap_fonts;
+
+	int linear;
+
+	// Scratch space for scaled images
+	uint32_t *image_row;
+	uint32_t *image_cols;
+	uint8_t *image_weights;
+	uint16_t *image_filtered; // Two horizontally filtered source rows
+	uint32_t cap_image_row, cap_image_cols, cap_image_weights, cap_image_filtered;
+
+	// Rasterized layers drawn more than once, indexed by layer index
+	nui_soft_instance *instances;
+	uint32_t cap_instances;
+	uint32_t pass; // Incremented by each `nui_soft_render()`
+
+	// Scratch space for progressive rendering
+	nui_soft_tile *tiles;
+	uint32_t cap_tiles;
+
+	// Verification mode, `verify_pixels` holds the full redraw
+	nui_soft_verify_fn *verify_fn;
+	void *verify_user;
+	char *verify_pixels;
+	uint32_t cap_verify_pixels;
+
+	// Glyph cache file
+	char *cache_path;
+	uint32_t cache_version;
+	const char *cache_data;
+	size_t cache_size;
+	int cache_dirty;
+} nui_soft_renderer;
+
+typedef struct nui_soft_target {
+	nui_surface *surface;
+	const nui_soft_pipeline *pipeline;
+	nui_rect bounds;
+	int instancing; // Copy layers drawn more than once from `instances`
+} nui_soft_target;
+
+static uint32_t utf8_decode(const char **p_str, const char *end)
+{
+	const uint8_t *s = (const uint8_t*)*p_str;
+	uint32_t c = *s++, extra = 0;
+	if (c >= 0xf0) { c &= 0x07; extra = 3; }
+	else if (c >= 0xe0) { c &= 0x0f; extra = 2; }
+	else if (c >= 0xc0) { c &= 0x1f; extra = 1; }
+	for (; extra > 0 && (const char*)s < end; extra--) {
+		c = c << 6 | (*s++ & 0x3f);
+	}
+	*p_str = (const char*)s;
+	return c;
+}
+
+static nui_soft_cached_glyph *insert_glyph(nui_soft_font *f, const nui_soft_cached_glyph *glyph)
+{
+	uint32_t mask = f->cap_glyphs - 1;
+	uint32_t ix = (glyph->key * 2654435761u) & mask;
+	while (f->glyphs[ix].key != 0) {
+		ix = (ix + 1) & mask;
+	}
+	f->glyphs[ix] = *glyph;
+	f->num_glyphs++;
+	return &f->glyphs[ix];
+}
+
+static void reserve_glyph(nui_soft_font *f)
+{
+	if ((f->num_glyphs + 1) * 4 <= f->cap_glyphs * 3) return;
+
+	nui_soft_cached_glyph *old = f->glyphs;
+	uint32_t old_cap = f->cap_glyphs;
+	f->cap_glyphs = old_cap ? old_cap * 2 : 256;
+	f->glyphs = (nui_soft_cached_glyph*)nui_alloc(f->cap_glyphs * sizeof(nui_soft_cached_glyph));
+	f->num_glyphs = 0;
+	for (uint32_t i = 0; i < old_cap; i++) {
+		if (old[i].key != 0) insert_glyph(f, &old[i]);
+	}
+	nui_free(old);
+}
+
+static const uint8_t *glyph_coverage(const nui_soft_font *f, const nui_soft_cached_glyph *g)
+{
+	if (g->coverage & NUI_SOFT_MAPPED_COVERAGE) {
+		return f->mapped_coverage + (g->coverage & ~NUI_SOFT_MAPPED_COVERAGE);
+	}
+	return f->coverage + g->coverage;
+}
+
+static const nui_soft_cached_glyph *find_mapped_glyph(const nui_soft_font *f, uint32_t key)
+{
+	uint32_t lo = 0, hi = f->num_mapped_glyphs;
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		const nui_soft_cached_glyph *g = &f->mapped_glyphs[mid];
+		if (g->key == key) {
+			// Don't trust the file for anything outside the font's coverage
+			// or metrics that could overflow when measuring
+			uint64_t end = (uint64_t)g->coverage + (uint64_t)g->width * g->height;
+			int sane = g->advance >= -0xffff && g->advance <= 0xffff;
+			return end <= f->mapped_coverage_size && sane ? g : NULL;
+		}
+		if (g->key < key) lo = mid + 1;
+		else hi = mid;
+	}
+	return NULL;
+}
+
+static void load_font(nui_soft_renderer *r, uint32_t font)
+{
+	nui_soft_font *f = &r->fonts[font];
+	f->loaded = 1;
+	if (r->source == NULL) return;
+
+	nui_font_desc desc;
+	desc.family = f->family;
+	desc.height = f->height;
+	f->line_height = r->source->load_font(r->source, font, &desc);
+}
+
+static const nui_soft_cached_glyph *get_glyph(nui_soft_renderer *r, uint32_t font, uint32_t codepoint)
+{
+	nui_soft_font *f = &r->fonts[font];
+	uint32_t key = codepoint + 1;
+	if (f->cap_glyphs > 0) {
+		uint32_t mask = f->cap_glyphs - 1;
+		for (uint32_t ix = (key * 2654435761u) & mask; f->glyphs[ix].key != 0; ix = (ix + 1) & mask) {
+			if (f->glyphs[ix].key == key) return &f->glyphs[ix];
+		}
+	}
+
+	const nui_soft_cached_glyph *mg = find_mapped_glyph(f, key);
+	if (mg) {
+		nui_soft_cached_glyph cg = *mg;
+		cg.coverage |= NUI_SOFT_MAPPED_COVERAGE;
+		reserve_glyph(f);
+		return insert_glyph(f, &cg);
+	}
+
+	if (!f->loaded) load_font(r, font);
+	r->cache_dirty = 1;
+
+	nui_soft_glyph g = { 0 };
+	g.advance = f->height / 2;
+	if (r->source == NULL || !r->source->rasterize(r->source, font, codepoint, &g)) {
+		g.width = g.height = 0;
+	}
+
+	nui_soft_cached_glyph cg;
+	cg.key = key;
+	cg.advance = g.advance;
+	cg.x = (int16_t)g.x;
+	cg.y = (int16_t)g.y;
+	cg.width = (uint16_t)g.width;
+	cg.height = (uint16_t)g.height;
+	cg.coverage = f->coverage_size;
+
+	uint32_t size = (uint32_t)(g.width * g.height);
+	if (size > 0) {
+		nui_buf_grow_uninit(&f->coverage, &f->coverage_cap, f->coverage_size + size);
+		memcpy(f->coverage + f->coverage_size, g.coverage, size);
+		f->coverage_size += size;
+	}
+
+	reserve_glyph(f);
+	return insert_glyph(f, &cg);
+}
+
+// Glyph cache file
+//
+// Native endian, all offsets from the start of the file:
+//   nui_soft_cache_header
+//   per font: family, glyphs sorted by key, coverage
+//   nui_soft_cache_font[num_fonts]
+// with everything 4 byte aligned.
+
+#define NUI_SOFT_CACHE_MAGIC 0x4743554eu // "NUCG"
+#define NUI_SOFT_CACHE_FORMAT 1
+
+typedef struct nui_soft_cache_header {
+	uint32_t magic;
+	uint32_t format;
+	uint32_t version;
+	uint32_t num_fonts;
+	uint32_t fonts; // Offset of `nui_soft_cache_font[num_fonts]`
+	uint32_t size;
+} nui_soft_cache_header;
+
+typedef struct nui_soft_cache_font {
+	uint32_t family, family_len;
+	int32_t height, line_height;
+	uint32_t glyphs, num_glyphs;
+	uint32_t coverage, coverage_size;
+} nui_soft_cache_font;
+
+#if defined(_WIN32)
+
+static const char *map_file(const char *path, size_t *p_size)
+{
+	HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE) return NULL;
+
+	const char *data = NULL;
+	LARGE_INTEGER size;
+	if (GetFileSizeEx(file, &size) && size.QuadPart > 0 && size.QuadPart <= UINT32_MAX) {
+		HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (mapping) {
+			// The view keeps the mapping alive
+			data = (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+			CloseHandle(mapping);
+		}
+	}
+	CloseHandle(file);
+
+	if (data) *p_size = (size_t)size.QuadPart;
+	return data;
+}
+
+static void unmap_file(const char *data, size_t size)
+{
+	(void)size;
+	UnmapViewOfFile(data);
+}
+
+static int sync_file(FILE *file)
+{
+	return fflush(file) == 0 && _commit(_fileno(file)) == 0;
+}
+
+static int replace_file(const char *src, const char *dst)
+{
+	return MoveFileExA(src, dst, MOVEFILE_REPLACE_EXISTING) != 0;
+}
+
+#else
+
+static const char *map_file(const char *path, size_t *p_size)
+{
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return NULL;
+
+	const char *data = NULL;
+	struct stat st;
+	if (fstat(fd, &st) == 0 && st.st_size > 0 && (uint64_t)st.st_size <= UINT32_MAX) {
+		void *ptr = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (ptr != MAP_FAILED) data = (const char*)ptr;
+	}
+	close(fd);
+
+	if (data) *p_size = (size_t)st.st_size;
+	return data;
+}
+
+static void unmap_file(const char *data, size_t size)
+{
+	munmap((void*)data, size);
+}
+
+static int sync_file(FILE *file)
+{
+	return fflush(file) == 0 && fsync(fileno(file)) == 0;
+}
+
+static int replace_file(const char *src, const char *dst)
+{
+	return rename(src, dst) == 0;
+}
+
+#endif
+
+static int cache_range_ok(const nui_soft_renderer *r, uint32_t offset, uint64_t size)
+{
+	return (offset & 3) == 0 && offset + size <= r->cache_size;
+}
+
+static int open_glyph_cache(nui_soft_renderer *r)
+{
+	r->cache_data = map_file(r->cache_path, &r->cache_size);
+	if (r->cache_data == NULL) return 0;
+
+	const nui_soft_cache_header *h = (const nui_soft_cache_header*)r->cache_data;
+	int ok = r->cache_size >= sizeof(nui_soft_cache_header)
+		&& h->magic == NUI_SOFT_CACHE_MAGIC && h->format == NUI_SOFT_CACHE_FORMAT
+		&& h->version == r->cache_version && h->size == r->cache_size
+		&& cache_range_ok(r, h->fonts, (uint64_t)h->num_fonts * sizeof(nui_soft_cache_font));
+
+	const nui_soft_cache_font *fonts = ok ? (const nui_soft_cache_font*)(r->cache_data + h->fonts) : NULL;
+	for (uint32_t i = 0; ok && i < h->num_fonts; i++) {
+		const nui_soft_cache_font *cf = &fonts[i];
+		ok = cf->family + (uint64_t)cf->family_len <= r->cache_size
+			&& cache_range_ok(r, cf->glyphs, (uint64_t)cf->num_glyphs * sizeof(nui_soft_cached_glyph))
+			&& cache_range_ok(r, cf->coverage, cf->coverage_size)
+			&& cf->coverage_size < NUI_SOFT_MAPPED_COVERAGE;
+	}
+
+	if (!ok) {
+		unmap_file(r->cache_data, r->cache_size);
+		r->cache_data = NULL;
+		r->cache_size = 0;
+	}
+	return ok;
+}
+
+static const nui_soft_cache_font *find_cache_font(const nui_soft_renderer *r, const char *family, int32_t height)
+{
+	if (r->cache_data == NULL) return NULL;
+
+	const nui_soft_cache_header *h = (const nui_soft_cache_header*)r->cache_data;
+	const nui_soft_cache_font *fonts = (const nui_soft_cache_font*)(r->cache_data + h->fonts);
+	size_t len = strlen(family);
+	for (uint32_t i = 0; i < h->num_fonts; i++) {
+		const nui_soft_cache_font *cf = &fonts[i];
+		if (cf->height == height && cf->family_len == len && !memcmp(r->cache_data + cf->family, family, len)) {
+			return cf;
+		}
+	}
+	return NULL;
+}
+
+typedef struct nui_soft_cache_writer {
+	char *data;
+	uint32_t size, cap;
+} nui_soft_cache_writer;
+
+static uint32_t cache_write(nui_soft_cache_writer *w, const void *data, size_t size)
+{
+	uint32_t offset = w->size;
+	uint32_t padded = (uint32_t)(size + 3) & ~3u;
+	nui_buf_grow_uninit(&w->data, &w->cap, w->size + padded);
+	if (size > 0) memcpy(w->data + offset, data, size);
+	memset(w->data + offset + size, 0, padded - size);
+	w->size += padded;
+	return offset;
+}
+
+static int compare_glyphs(const void *a, const void *b)
+{
+	uint32_t ka = ((const nui_soft_cached_glyph*)a)->key, kb = ((const nui_soft_cached_glyph*)b)->key;
+	return ka < kb ? -1 : ka > kb;
+}
+
+// Mapped glyphs and everything rasterized this session
+static void write_cache_font(nui_soft_cache_writer *w, nui_soft_cache_font *cf, const nui_soft_font *f)
+{
+	// Tag the mapped glyphs so `glyph_coverage()` works for both kinds
+	nui_soft_cached_glyph *glyphs = (nui_soft_cached_glyph*)nui_alloc((f->num_mapped_glyphs + f->num_glyphs + 1) * sizeof(nui_soft_cached_glyph));
+	uint32_t num_glyphs = 0;
+	for (uint32_t i = 0; i < f->num_mapped_glyphs; i++) {
+		const nui_soft_cached_glyph *g = find_mapped_glyph(f, f->mapped_glyphs[i].key);
+		if (g != &f->mapped_glyphs[i]) continue;
+		glyphs[num_glyphs] = *g;
+		glyphs[num_glyphs++].coverage |= NUI_SOFT_MAPPED_COVERAGE;
+	}
+	for (uint32_t i = 0; i < f->cap_glyphs; i++) {
+		const nui_soft_cached_glyph *g = &f->glyphs[i];
+		if (g->key == 0 || (g->coverage & NUI_SOFT_MAPPED_COVERAGE)) continue;
+		glyphs[num_glyphs++] = *g;
+	}
+	qsort(glyphs, num_glyphs, sizeof(nui_soft_cached_glyph), &compare_glyphs);
+
+	size_t family_len = strlen(f->family);
+	cf->family = cache_write(w, f->family, family_len);
+	cf->family_len = (uint32_t)family_len;
+	cf->height = f->height;
+	cf->line_height = f->line_height;
+
+	// Reserve the glyphs, they get their offsets as the coverage is appended
+	cf->num_glyphs = num_glyphs;
+	cf->glyphs = cache_write(w, glyphs, num_glyphs * sizeof(nui_soft_cached_glyph));
+
+	cf->coverage = w->size;
+	for (uint32_t i = 0; i < num_glyphs; i++) {
+		nui_soft_cached_glyph *g = &glyphs[i];
+		const uint8_t *coverage = glyph_coverage(f, g);
+		g->coverage = w->size - cf->coverage;
+		nui_buf_grow_uninit(&w->data, &w->cap, w->size + (uint32_t)g->width * g->height);
+		memcpy(w->data + w->size, coverage, (size_t)g->width * g->height);
+		w->size += (uint32_t)g->width * g->height;
+	}
+	cf->coverage_size = w->size - cf->coverage;
+	cache_write(w, NULL, 0);
+
+	memcpy(w->data + cf->glyphs, glyphs, num_glyphs * sizeof(nui_soft_cached_glyph));
+	nui_free(glyphs);
+}
+
+static int session_has_font(const nui_soft_renderer *r, uint32_t count, const char *family, size_t family_len, int32_t height)
+{
+	for (uint32_t i = 0; i < count; i++) {
+		const nui_soft_font *f = &r->fonts[i];
+		if (f->family && f->height == height && strlen(f->family) == family_len && !memcmp(f->family, family, family_len)) return 1;
+	}
+	return 0;
+}
+
+// Written to a temporary file that then replaces the cache so readers never
+// see a partial file. Fonts from the old file not used this time are kept.
+static int save_glyph_cache(nui_soft_renderer *r)
+{
+	nui_soft_cache_writer w = { 0 };
+	nui_soft_cache_font *fonts = NULL;
+	uint32_t num_fonts = 0, cap_fonts = 0;
+
+	nui_soft_cache_header header = { 0 };
+	cache_write(&w, &header, sizeof(header));
+
+	for (uint32_t i = 0; i < r->cap_fonts; i++) {
+		const nui_soft_font *f = &r->fonts[i];
+		if (f->family == NULL || session_has_font(r, i, f->family, strlen(f->family), f->height)) continue;
+		nui_buf_grow(&fonts, &cap_fonts, num_fonts + 1);
+		write_cache_font(&w, &fonts[num_fonts++], f);
+	}
+
+	if (r->cache_data) {
+		const nui_soft_cache_header *old = (const nui_soft_cache_header*)r->cache_data;
+		const nui_soft_cache_font *old_fonts = (const nui_soft_cache_font*)(r->cache_data + old->fonts);
+		for (uint32_t i = 0; i < old->num_fonts; i++) {
+			const nui_soft_cache_font *of = &old_fonts[i];
+			if (session_has_font(r, r->cap_fonts, r->cache_data + of->family, of->family_len, of->height)) continue;
+			nui_buf_grow(&fonts, &cap_fonts, num_fonts + 1);
+			nui_soft_cache_font *cf = &fonts[num_fonts++];
+			*cf = *of;
+			cf->family = cache_write(&w, r->cache_data + of->family, of->family_len);
+			cf->glyphs = cache_write(&w, r->cache_data + of->glyphs, of->num_glyphs * sizeof(nui_soft_cached_glyph));
+			cf->coverage = cache_write(&w, r->cache_data + of->coverage, of->coverage_size);
+		}
+	}
+
+	header.magic = NUI_SOFT_CACHE_MAGIC;
+	header.format = NUI_SOFT_CACHE_FORMAT;
+	header.version = r->cache_version;
+	header.num_fonts = num_fonts;
+	header.fonts = cache_write(&w, fonts, num_fonts * sizeof(nui_soft_cache_font));
+	header.size = w.size;
+	memcpy(w.data, &header, sizeof(header));
+	nui_free(fonts);
+
+	size_t path_len = strlen(r->cache_path);
+	char *tmp_path = (char*)nui_alloc(path_len + 5);
+	memcpy(tmp_path, r->cache_path, path_len);
+	memcpy(tmp_path + path_len, ".tmp", 5);
+
+	FILE *file = fopen(tmp_path, "wb");
+	int ok = file != NULL;
+	if (file) {
+		ok = fwrite(w.data, 1, w.size, file) == w.size;
+		// On disk before the rename, or a crash may leave a truncated cache
+		ok = ok && sync_file(file);
+		ok = fclose(file) == 0 && ok;
+	}
+	nui_free(w.data);
+
+	// Windows can't replace a file that is still mapped
+	if (r->cache_data) {
+		unmap_file(r->cache_data, r->cache_size);
+		r->cache_data = NULL;
+		r->cache_size = 0;
+	}
+
+	ok = ok && replace_file(tmp_path, r->cache_path);
+	if (!ok) remove(tmp_path);
+	nui_free(tmp_path);
+	return ok;
+}
+
+// Renderer interface
+
+static void drop_instance(nui_soft_renderer *r, uint32_t index)
+{
+	if (index >= r->cap_instances || !r->instances[index].pixels) return;
+	nui_soft_instance *inst = &r->instances[index];
+	nui_free(inst->pixels);
+	memset(inst, 0, sizeof(nui_soft_instance));
+}
+
+static void nui_soft_make_font(nui_renderer *nr, uint32_t font, const nui_font_desc *desc)
+{
+	nui_soft_renderer *r = (nui_soft_renderer*)nr;
+
+	nui_buf_grow(&r->fonts, &r->cap_fonts, font + 1);
+	nui_soft_font *f = &r->fonts[font];
+	if (f->family) {
+		// Slot of a freed font, cached instances may show its glyphs under
+		// the same draw hashes
+		for (uint32_t i = 0; i < r->cap_instances; i++) {
+			drop_instance(r, i);
+		}
+	}
+	nui_free(f->family);
+	nui_free(f->glyphs);
+	nui_free(f->coverage);
+	memset(f, 0, sizeof(nui_soft_font));
+
+	const char *family = desc->family ? desc->family : "";
+	size_t family_len = strlen(family);
+	f->family = (char*)nui_alloc(family_len + 1);
+	memcpy(f->family, family, family_len + 1);
+	f->height = desc->height;
+	f->line_height = desc->height;
+
+	const nui_soft_cache_font *cf = find_cache_font(r, family, desc->height);
+	if (cf) {
+		f->line_height = cf->line_height;
+		f->mapped_glyphs = (const nui_soft_cached_glyph*)(r->cache_data + cf->glyphs);
+		f->num_mapped_glyphs = cf->num_glyphs;
+		f->mapped_coverage = (const uint8_t*)r->cache_data + cf->coverage;
+		f->mapped_coverage_size = cf->coverage_size;
+	} else {
+		load_font(r, font);
+		r->cache_dirty = 1;
+	}
+}
+
+static nui_extent nui_soft_measure(nui_renderer *nr, uint32_t font, const char *str, size_t len)
+{
+	nui_soft_renderer *r = (nui_soft_renderer*)nr;
+
+	int32_t width = 0;
+	const char *end = str + len;
+	while (str != end) {
+		uint32_t cp = utf8_decode(&str, end);
+		width += get_glyph(r, font, cp)->advance;
+	}
+
+	return nui_ex(width, r->fonts[font].line_height);
+}
+
+static void nui_soft_measure_many(nui_renderer *nr, uint32_t font, const char *const *strs, const size_t *lens, uint32_t count, nui_extent *extents)
+{
+	for (uint32_t i = 0; i < count; i++) {
+		extents[i] = nui_soft_measure(nr, font, strs[i], lens[i]);
+	}
+}
+
+static nui_extent nui_soft_measure_prefixes(nui_renderer *nr, uint32_t font, const char *str, size_t len, int32_t *advances)
+{
+	nui_soft_renderer *r = (nui_soft_renderer*)nr;
+
+	int32_t width = 0;
+	const char *begin = str, *end = str + len;
+	while (str != end) {
+		const char *cp_begin = str;
+		uint32_t cp = utf8_decode(&str, end);
+		width += get_glyph(r, font, cp)->advance;
+		for (const char *p = cp_begin; p != str; p++) {
+			advances[p - begin] = width;
+		}
+	}
+
+	return nui_ex(width, r->fonts[font].line_height);
+}
+
+static void nui_soft_release_layer(nui_renderer *nr, uint32_t layer)
+{
+	drop_instance((nui_soft_renderer*)nr, layer);
+}
+
+static void nui_soft_free(nui_renderer *nr)
+{
+	nui_soft_renderer *r = (nui_soft_renderer*)nr;
+	if (r->cache_path && r->cache_dirty) {
+		save_glyph_cache(r);
+	}
+	if (r->cache_data) {
+		unmap_file(r->cache_data, r->cache_size);
+	}
+	nui_free(r->cache_path);
+
+	for (uint32_t i = 0; i < r->cap_fonts; i++) {
+		nui_free(r->fonts[i].family);
+		nui_free(r->fonts[i].glyphs);
+		nui_free(r->fonts[i].coverage);
+	}
+	if (r->source) {
+		r->source->free(r->source);
+	}
+	nui_free(r->fonts);
+	nui_free(r->image_row);
+	nui_free(r->image_cols);
+	nui_free(r->image_weights);
+	nui_free(r->image_filtered);
+	for (uint32_t i = 0; i < r->cap_instances; i++) {
+		nui_free(r->instances[i].pixels);
+	}
+	nui_free(r->instances);
+	nui_free(r->tiles);
+	nui_free(r->verify_pixels);
+	nui_free(r);
+}
+
+nui_renderer *nui_soft_renderer_make(nui_soft_font_source *fonts)
+{
+	nui_soft_renderer *r = nui_make(nui_soft_renderer);
+	r->r.make_font = &nui_soft_make_font;
+	r->r.measure = &nui_soft_measure;
+	r->r.measure_many = &nui_soft_measure_many;
+	r->r.measure_prefixes = &nui_soft_measure_prefixes;
+	r->r.free = &nui_soft_free;
+	r->r.release_layer = &nui_soft_release_layer;
+
+	r->source = fonts;
+
+	return &r->r;
+}
+
+int nui_soft_set_glyph_cache(nui_renderer *nr, const char *path, uint32_t version)
+{
+	nui_soft_renderer *r = (nui_soft_renderer*)nr;
+	nui_assert(r->cache_path == NULL);
+
+	size_t len = strlen(path);
+	r->cache_path = (char*)nui_alloc(len + 1);
+	memcpy(r->cache_path, path, len + 1);
+	r->cache_version = version;
+
+	return open_glyph_cache(r);
+}
+
+void nui_soft_set_linear_blending(nui_renderer *nr, int linear)
+{
+	nui_soft_renderer *r = (nui_soft_renderer*)nr;
+	if (linear) init_linear_tables();
+	r->linear = linear != 0;
+}
+
+// `rect` in surface coordinates
+static void fill_rect(nui_soft_target *t, nui_rect rect, nui_color color, nui_blend_mode mode)
+{
+	if (!clip_rect(&rect, &t->bounds)) return;
+	if (mode == nui_bm_over) {
+		if (color.a == 0) return;
+		if (color.a == 255) mode = nui_bm_copy;
+	}
+
+	nui_fill_span_fn *fill = t->pipeline->fill[mode];
+	int32_t count = rect.right - rect.left;
+	for (int32_t y = rect.top; y < rect.bottom; y++) {
+		fill(pixel_ptr(t->surface, rect.left, y), count, color);
+	}
+}
+
+static void draw_text(nui_soft_renderer *r, nui_soft_target *t, const nui_text_draw *draw, nui_point pos, const nui_rect *clip)
+{
+	nui_soft_font *f = &r->fonts[draw->font];
+	nui_mask_span_fn *mask = t->pipeline->mask;
+
+	const char *str = draw->text, *end = draw->text + draw->text_len;
+	int32_t x = pos.x;
+	while (str != end) {
+		uint32_t cp = utf8_decode(&str, end);
+		const nui_soft_cached_glyph *g = get_glyph(r, draw->font, cp);
+
+		nui_point gp = nui_pt(x + g->x, pos.y + g->y);
+		x += g->advance;
+
+		nui_rect gr;
+		gr.min = gp;
+		gr.max = nui_pt(gp.x + g->width, gp.y + g->height);
+		if (!clip_rect(&gr, clip)) continue;
+
+		const uint8_t *coverage = glyph_coverage(f, g) + (gr.left - gp.x);
+		int32_t count = gr.right - gr.left;
+		for (int32_t y = gr.top; y < gr.bottom; y++) {
+			const uint8_t *row = coverage + (size_t)(y - gp.y) * g->width;
+			mask(pixel_ptr(t->surface, gr.left, y), row, count, draw->color);
+		}
+	}
+}
+
+static const uint32_t *image_row(const nui_image_desc *img, int32_t y)
+{
+	return (const uint32_t*)((const char*)img->pixels + (size_t)y * img->stride);
+}
+
+// Source position of destination pixel `i` in 16.16 fixed point. Bilinear
+// filtering samples half a texel earlier to center the texels.
+static int64_t image_sample_pos(int64_t i, int64_t step, int64_t bias, int32_t size)
+{
+	int64_t pos = i * step + step / 2 - bias, max = (int64_t)(size - 1) << 16;
+	return pos < 0 ? 0 : pos > max ? max : pos;
+}
+
+static void draw_image(nui_soft_renderer *r, nui_soft_target *t, const nui_image_draw *draw, nui_point offset, const nui_rect *clip)
+{
+	const nui_image_desc *img = nui_image_info(draw->image);
+	const nui_rect *src = &draw->src;
+
+	nui_rect dst;
+	dst.min = nui_offset(draw->draw.bounds.min, offset);
+	dst.max = nui_offset(draw->draw.bounds.max, offset);
+	nui_rect rc = dst;
+	if (!clip_rect(&rc, clip)) return;
+
+	nui_blit_span_fn *blit = t->pipeline->blit[nui_bm_over];
+	int32_t count = rc.right - rc.left;
+	int32_t sw = src->right - src->left, sh = src->bottom - src->top;
+	int32_t dw = dst.right - dst.left, dh = dst.bottom - dst.top;
+
+	// Unscaled images are blended straight from the source pixels
+	if (sw == dw && sh == dh) {
+		for (int32_t y = rc.top; y < rc.bottom; y++) {
+			const uint32_t *row = image_row(img, src->top + y - dst.top) + src->left + (rc.left - dst.left);
+			blit(pixel_ptr(t->surface, rc.left, y), row, count);
+		}
+		return;
+	}
+
+	int bilinear = draw->filter == nui_if_bilinear;
+	int64_t bias = bilinear ? 0x8000 : 0;
+	int64_t step_x = ((int64_t)sw << 16) / dw;
+	int64_t step_y = ((int64_t)sh << 16) / dh;
+
+	nui_buf_grow_uninit(&r->image_row, &r->cap_image_row, (uint32_t)count);
+	nui_buf_grow_uninit(&r->image_cols, &r->cap_image_cols, (uint32_t)count);
+	nui_buf_grow_uninit(&r->image_weights, &r->cap_image_weights, (uint32_t)count);
+	for (int32_t i = 0; i < count; i++) {
+		int64_t pos = image_sample_pos(rc.left - dst.left + i, step_x, bias, sw);
+		r->image_cols[i] = (uint32_t)(src->left + (pos >> 16));
+		r->image_weights[i] = (uint8_t)(pos >> 8);
+	}
+
+	// Source rows in the two halves of `image_filtered`
+	int32_t filtered[2] = { -1, -1 };
+	if (bilinear) {
+		nui_buf_grow_uninit(&r->image_filtered, &r->cap_image_filtered, (uint32_t)count * 8);
+	}
+
+	for (int32_t y = rc.top; y < rc.bottom; y++) {
+		int64_t pos = image_sample_pos(y - dst.top, step_y, bias, sh);
+		int32_t sy = src->top + (int32_t)(pos >> 16);
+		uint32_t wy = (uint32_t)(pos >> 8) & 0xff;
+		if (bilinear) {
+			// Rows only move downwards so the lower one is evicted first
+			const uint16_t *h[2];
+			for (int k = 0; k < 2; k++) {
+				int32_t fy = sy + (k == 1 && wy != 0);
+				int slot = filtered[1] == fy || (filtered[0] != fy && filtered[1] < filtered[0]);
+				uint16_t *row = r->image_filtered + (size_t)slot * count * 4;
+				if (filtered[slot] != fy) {
+					bilinear_h(row, image_row(img, fy), r->image_cols, r->image_weights, count);
+					filtered[slot] = fy;
+				}
+				h[k] = row;
+			}
+			bilinear_v(r->image_row, h[0], h[1], count, wy);
+		} else {
+			nearest_span(r->image_row, image_row(img, sy), r->image_cols, count);
+		}
+		blit(pixel_ptr(t->surface, rc.left, y), r->image_row, count);
+	}
+}
+
+static void render(nui_soft_renderer *r, nui_soft_target *t, const nui_render_info *ri, int redraw);
+
+// Render the whole layer to its instance surface unless it is up to date,
+// returns NULL if another instance needs it for a different background
+// during this pass
+static nui_soft_instance *update_instance(nui_soft_renderer *r, const nui_soft_target *t, const nui_render_info *ri)
+{
+	nui_layer *l = ri->layer;
+	uint32_t index = nui_layer_index(l);
+	nui_buf_grow(&r->instances, &r->cap_instances, index + 1);
+	nui_soft_instance *inst = &r->instances[index];
+
+	nui_extent size = nui_layer_size(l);
+	nui_pixel_format format = t->surface->format;
+	uint64_t hash = nui_layer_content_hash(l);
+	if (inst->valid && inst->content_hash == hash && nui_color_eq(inst->bg_color, ri->bg_color)
+		&& inst->linear == r->linear && inst->surface.format == format
+		&& inst->surface.width == size.x && inst->surface.height == size.y) {
+		return inst;
+	}
+	if (inst->valid && inst->pass == r->pass) return NULL;
+
+	nui_trace_begin(instance);
+
+	int32_t stride = size.x * (int32_t)nui_pixel_size(format);
+	nui_buf_grow_uninit(&inst->pixels, &inst->cap_pixels, (uint32_t)stride * (uint32_t)size.y);
+	inst->surface.pixels = inst->pixels;
+	inst->surface.width = size.x;
+	inst->surface.height = size.y;
+	inst->surface.stride = stride;
+	inst->surface.format = format;
+	inst->bg_color = ri->bg_color;
+	inst->content_hash = hash;
+	inst->linear = r->linear;
+	inst->valid = 1;
+	inst->pass = r->pass;
+
+	// Nested instances may grow `instances`, so render through a copy
+	nui_surface surface = inst->surface;
+	nui_soft_target it;
+	it.surface = &surface;
+	it.pipeline = t->pipeline;
+	it.bounds.min = nui_pt(0, 0);
+	it.bounds.max = nui_pt(size.x, size.y);
+	it.instancing = 1;
+
+	nui_render_info iri;
+	iri.layer = l;
+	iri.clip = it.bounds;
+	iri.offset = nui_pt(0, 0);
+	iri.bg_color = ri->bg_color;
+	render(r, &it, &iri, 1);
+
+	nui_trace_end_arg(instance, "render_instance", "layer", index);
+	return r->instances + index;
+}
+
+static void render_instance(nui_soft_renderer *r, nui_soft_target *t, const nui_render_info *ri)
+{
+	nui_soft_instance *inst = update_instance(r, t, ri);
+	if (!inst) {
+		render(r, t, ri, 1);
+		return;
+	}
+
+	nui_rect clip;
+	clip.min = nui_offset(ri->clip.min, ri->offset);
+	clip.max = nui_offset(ri->clip.max, ri->offset);
+	if (!clip_rect(&clip, &t->bounds)) return;
+
+	size_t row_size = (size_t)(clip.right - clip.left) * nui_pixel_size(inst->surface.format);
+	for (int32_t y = clip.top; y < clip.bottom; y++) {
+		memcpy(pixel_ptr(t->surface, clip.left, y),
+			pixel_ptr(&inst->surface, clip.left - ri->offset.x, y - ri->offset.y), row_size);
+	}
+}
+
+static void render(nui_soft_renderer *r, nui_soft_target *t, const nui_render_info *ri, int redraw)
+{
+	nui_trace_begin(layer);
+
+	nui_draw *ptr = nui_draws_begin(ri->layer);
+	nui_draw *end = nui_draws_end(ri->layer);
+
+	nui_color bg = nui_blend_over(ri->bg_color, nui_layer_bg_color(ri->layer));
+	if (nui_layer_invalidation(ri->layer) >= nui_inv_self) {
+		redraw = 1;
+	}
+
+	// Clip in surface coordinates
+	nui_rect clip;
+	clip.left = ri->clip.left + ri->offset.x;
+	clip.top = ri->clip.top + ri->offset.y;
+	clip.right = ri->clip.right + ri->offset.x;
+	clip.bottom = ri->clip.bottom + ri->offset.y;
+	if (!clip_rect(&clip, &t->bounds)) {
+		nui_trace_end_arg(layer, "render_layer", "layer", nui_layer_index(ri->layer));
+		return;
+	}
+
+	if (redraw) {
+		fill_rect(t, clip, bg, nui_bm_copy);
+	}
+
+	// Clip in layer coordinates, both are narrowed by clip draws
+	nui_rect local_clip = ri->clip;
+	nui_rect clip_stack[NUI_MAX_CLIP_DEPTH][2];
+	uint32_t clip_depth = 0;
+
+	for (; ptr != end; ptr = nui_next_draw(ptr)) {
+		if (ptr->type == nui_dt_clip_push) {
+			nui_rect lc = ptr->bounds;
+			if (!clip_rect(&lc, &local_clip)) {
+				ptr = nui_clip_end(ptr);
+				continue;
+			}
+			clip_stack[clip_depth][0] = local_clip;
+			clip_stack[clip_depth][1] = clip;
+			clip_depth++;
+			local_clip = lc;
+			clip.min = nui_offset(lc.min, ri->offset);
+			clip.max = nui_offset(lc.max, ri->offset);
+			clip_rect(&clip, &clip_stack[clip_depth - 1][1]);
+			continue;
+		}
+		if (ptr->type == nui_dt_clip_pop) {
+			clip_depth--;
+			local_clip = clip_stack[clip_depth][0];
+			clip = clip_stack[clip_depth][1];
+			continue;
+		}
+
+		if (!nui_intersects(&ptr->bounds, &local_clip)) continue;
+
+		switch (ptr->type) {
+
+		case nui_dt_rect: if (redraw) {
+			nui_rect_draw *draw = (nui_rect_draw*)ptr;
+			nui_rect rc;
+			rc.min = nui_offset(draw->draw.bounds.min, ri->offset);
+			rc.max = nui_offset(draw->draw.bounds.max, ri->offset);
+			if (clip_rect(&rc, &clip)) {
+				fill_rect(t, rc, draw->color, nui_bm_over);
+			}
+		} break;
+
+		case nui_dt_text: if (redraw) {
+			nui_text_draw *draw = (nui_text_draw*)ptr;
+			nui_point p = nui_offset(draw->draw.bounds.min, ri->offset);
+			draw_text(r, t, draw, p, &clip);
+		} break;
+
+		case nui_dt_image: if (redraw) {
+			draw_image(r, t, (nui_image_draw*)ptr, ri->offset, &clip);
+		} break;
+
+		case nui_dt_layer: {
+			nui_layer_draw *draw = (nui_layer_draw*)ptr;
+			nui_point p = draw->draw.bounds.min;
+			nui_extent size = nui_layer_size(draw->layer);
+
+			nui_render_info lri;
+			lri.layer = draw->layer;
+			lri.offset = nui_offset(ri->offset, p);
+			lri.clip.min.x = nui_max(local_clip.min.x - p.x, 0);
+			lri.clip.min.y = nui_max(local_clip.min.y - p.y, 0);
+			lri.clip.max.x = nui_min(local_clip.max.x - p.x, size.x);
+			lri.clip.max.y = nui_min(local_clip.max.y - p.y, size.y);
+			lri.bg_color = bg;
+			if (nui_layer_num_instances(draw->layer) <= 1) {
+				drop_instance(r, nui_layer_index(draw->layer));
+				render(r, t, &lri, redraw);
+			} else if (!t->instancing) {
+				render(r, t, &lri, redraw);
+			} else if (redraw || nui_layer_invalidation(draw->layer) != nui_inv_none) {
+				render_instance(r, t, &lri);
+			}
+		} break;
+
+		default: break;
+		}
+	}
+
+	nui_trace_end_arg(layer, "render_layer", "layer", nui_layer_index(ri->layer));
+}
+
+static nui_color read_pixel(const nui_surface *s, int32_t x, int32_t y)
+{
+	nui_px_bgra8 px;
+	converters[nui_pf_bgra8][s->format](&px, pixel_ptr(s, x, y), 1);
+	return unpack_bgra8(px);
+}
+
+static void report_mismatch(nui_soft_renderer *r, const nui_render_info *ri, nui_soft_mismatch *m)
+{
+	nui_layer *root = ri->layer;
+	nui_point p = nui_pt(m->pixel.x - ri->offset.x, m->pixel.y - ri->offset.y);
+	if (!nui_hit_test(nui_layer_canvas(root), root, p, &m->hit)) {
+		m->hit.depth = 0;
+	}
+
+	if (m->hit.depth > 0) {
+		nui_layer *l = m->hit.layers[m->hit.depth - 1];
+		nui_point hp = m->hit.point;
+		nui_draw *end = nui_draws_end(l);
+		for (nui_draw *d = nui_draws_begin(l); d != end; d = nui_next_draw(d)) {
+			const nui_rect *b = &d->bounds;
+			if (hp.x < b->left || hp.y < b->top || hp.x >= b->right || hp.y >= b->bottom) continue;
+			if (m->num_draws == NUI_SOFT_MISMATCH_DRAWS) {
+				memmove(m->draws, m->draws + 1, (NUI_SOFT_MISMATCH_DRAWS - 1) * sizeof(nui_draw*));
+				m->num_draws--;
+			}
+			m->draws[m->num_draws++] = d;
+		}
+	}
+
+	m->num_damage = nui_layer_damage(root, m->damage, NUI_SOFT_MISMATCH_DAMAGE);
+
+	r->verify_fn(r->verify_user, m);
+}
+
+// Redraw everything into the scratch surface and compare
+static void verify_render(nui_soft_renderer *r, const nui_soft_target *t, const nui_render_info *ri)
+{
+	nui_surface *dst = t->surface;
+	nui_rect clip;
+	clip.min = nui_offset(ri->clip.min, ri->offset);
+	clip.max = nui_offset(ri->clip.max, ri->offset);
+	if (!clip_rect(&clip, &t->bounds)) return;
+
+	nui_trace_begin(verify);
+
+	uint32_t pixel_size = nui_pixel_size(dst->format);
+	nui_surface full = *dst;
+	full.stride = dst->width * (int32_t)pixel_size;
+	nui_buf_grow_uninit(&r->verify_pixels, &r->cap_verify_pixels, (uint32_t)full.stride * (uint32_t)dst->height);
+	full.pixels = r->verify_pixels;
+
+	// Render instances directly to check their cached copies too
+	nui_soft_target ft = *t;
+	ft.surface = &full;
+	ft.instancing = 0;
+	render(r, &ft, ri, 1);
+
+	nui_soft_mismatch m;
+	memset(&m, 0, sizeof(m));
+	int found = 0;
+	size_t row_size = (size_t)(clip.right - clip.left) * pixel_size;
+	for (int32_t y = clip.top; y < clip.bottom; y++) {
+		const char *a = (const char*)pixel_ptr(dst, clip.left, y);
+		const char *b = (const char*)pixel_ptr(&full, clip.left, y);
+		if (!memcmp(a, b, row_size)) continue;
+
+		for (int32_t x = clip.left; x < clip.right; x++) {
+			size_t offset = (size_t)(x - clip.left) * pixel_size;
+			if (!memcmp(a + offset, b + offset, pixel_size)) continue;
+			if (!found) {
+				found = 1;
+				m.pixel = nui_pt(x, y);
+				m.diff.min = m.pixel;
+				m.diff.max = nui_pt(x + 1, y + 1);
+			}
+			m.diff.left = nui_min(m.diff.left, x);
+			m.diff.right = nui_max(m.diff.right, x + 1);
+			m.diff.bottom = y + 1;
+		}
+	}
+
+	if (found) {
+		m.actual = read_pixel(dst, m.pixel.x, m.pixel.y);
+		m.expected = read_pixel(&full, m.pixel.x, m.pixel.y);
+		report_mismatch(r, ri, &m);
+		nui_soft_convert(dst, &full, &m.diff);
+	}
+
+	nui_trace_end(verify, "soft_verify");
+}
+
+void nui_soft_set_verify(nui_renderer *nr, nui_soft_verify_fn *fn, void *user)
+{
+	nui_soft_renderer *r = (nui_soft_renderer*)nr;
+	r->verify_fn = fn;
+	r->verify_user = user;
+}
+
+static const char *invalidation_name(nui_invalidation inv)
+{
+	switch (inv) {
+	case nui_inv_none: return "none";
+	case nui_inv_child: return "child";
+	case nui_inv_self: return "self";
+	case nui_inv_resize: return "resize";
+	default: return "?";
+	}
+}
+
+static const char *draw_type_name(nui_draw_type type)
+{
+	switch (type) {
+	case nui_dt_rect: return "rect";
+	case nui_dt_text: return "text";
+	case nui_dt_layer: return "layer";
+	case nui_dt_clip_push: return "clip_push";
+	case nui_dt_clip_pop: return "clip_pop";
+	case nui_dt_image: return "image";
+	default: return "?";
+	}
+}
+
+int nui_soft_format_mismatch(char *buf, size_t size, const nui_soft_mismatch *m)
+{
+	size_t len = 0;
+	#define NUI_SOFT_APPEND(...) do { \
+		int n = snprintf(len < size ? buf + len : NULL, len < size ? size - len : 0, __VA_ARGS__); \
+		if (n > 0) len += (size_t)n; \
+	} while (0)
+
+	NUI_SOFT_APPEND("mismatch at (%d, %d): got %02x%02x%02x%02x, expected %02x%02x%02x%02x, differing area [%d %d %d %d]\n",
+		m->pixel.x, m->pixel.y,
+		m->actual.r, m->actual.g, m->actual.b, m->actual.a,
+		m->expected.r, m->expected.g, m->expected.b, m->expected.a,
+		m->diff.left, m->diff.top, m->diff.right, m->diff.bottom);
+
+	NUI_SOFT_APPEND("layers:");
+	for (uint32_t i = 0; i < m->hit.depth; i++) {
+		nui_layer *l = m->hit.layers[i];
+		NUI_SOFT_APPEND(" %u (%s)", nui_layer_index(l), invalidation_name(nui_layer_invalidation(l)));
+	}
+	NUI_SOFT_APPEND(", at (%d, %d)\n", m->hit.point.x, m->hit.point.y);
+
+	for (uint32_t i = 0; i < m->num_draws; i++) {
+		const nui_draw *d = m->draws[i];
+		NUI_SOFT_APPEND("draw %s [%d %d %d %d]", draw_type_name(d->type),
+			d->bounds.left, d->bounds.top, d->bounds.right, d->bounds.bottom);
+		if (d->type == nui_dt_rect) {
+			nui_color c = ((const nui_rect_draw*)d)->color;
+			NUI_SOFT_APPEND(" %02x%02x%02x%02x", c.r, c.g, c.b, c.a);
+		} else if (d->type == nui_dt_text) {
+			const nui_text_draw *td = (const nui_text_draw*)d;
+			NUI_SOFT_APPEND(" \"%.*s\"", (int)nui_min((int32_t)td->text_len, 64), td->text);
+		} else if (d->type == nui_dt_layer) {
+			NUI_SOFT_APPEND(" %u", nui_layer_index(((const nui_layer_draw*)d)->layer));
+		}
+		NUI_SOFT_APPEND("\n");
+	}
+
+	NUI_SOFT_APPEND("damage:");
+	for (uint32_t i = 0; i < m->num_damage; i++) {
+		const nui_rect *r = &m->damage[i];
+		NUI_SOFT_APPEND(" [%d %d %d %d]", r->left, r->top, r->right, r->bottom);
+	}
+	NUI_SOFT_APPEND("\n");
+
+	#undef NUI_SOFT_APPEND
+	return (int)len;
+}
+
+static void init_target(nui_soft_renderer *r, nui_soft_target *t, nui_surface *dst)
+{
+	t->surface = dst;
+	t->pipeline = pipelines[r->linear][dst->format];
+	t->bounds.left = 0;
+	t->bounds.top = 0;
+	t->bounds.right = dst->width;
+	t->bounds.bottom = dst->height;
+	t->instancing = 1;
+}
+
+// Redraw `area` of `ri->layer` in layer coordinates
+static void render_area(nui_soft_renderer *r, nui_soft_target *t, const nui_render_info *ri, const nui_rect *area)
+{
+	nui_render_info ari = *ri;
+	if (!clip_rect(&ari.clip, area)) return;
+	render(r, t, &ari, 1);
+}
+
+void nui_soft_render(nui_surface *dst, const nui_render_info *ri)
+{
+	nui_soft_renderer *r = (nui_soft_renderer*)nui_layer_renderer(ri->layer);
+
+	nui_soft_target t;
+	init_target(r, &t, dst);
+	r->pass++;
+
+	nui_trace_begin(render);
+
+	uint32_t num_stale;
+	const nui_rect *stale = nui_layer_stale(ri->layer, &num_stale);
+	for (uint32_t i = 0; i < num_stale; i++) {
+		render_area(r, &t, ri, &stale[i]);
+	}
+	nui_clear_stale(ri->layer);
+
+	render(r, &t, ri, 0);
+	nui_trace_end(render, "soft_render");
+
+	if (r->verify_fn) {
+		verify_render(r, &t, ri);
+	}
+}
+
+static int compare_tiles(const void *a, const void *b)
+{
+	const nui_soft_tile *ta = (const nui_soft_tile*)a, *tb = (const nui_soft_tile*)b;
+	if (ta->priority != tb->priority) return ta->priority < tb->priority ? -1 : 1;
+	if (ta->rect.top != tb->rect.top) return ta->rect.top < tb->rect.top ? -1 : 1;
+	return ta->rect.left < tb->rect.left ? -1 : ta->rect.left > tb->rect.left;
+}
+
+static uint64_t tile_distance(const nui_rect *rect, nui_point p)
+{
+	int64_t dx = nui_max(nui_max(rect->left - p.x, p.x - (rect->right - 1)), 0);
+	int64_t dy = nui_max(nui_max(rect->top - p.y, p.y - (rect->bottom - 1)), 0);
+	return (uint64_t)(dx * dx + dy * dy);
+}
+
+static void add_rendered(nui_soft_progress *p, const nui_rect *rect)
+{
+	// Join with a rect sharing a whole edge, tiles mostly arrive in rows
+	for (uint32_t i = 0; i < p->num_rendered; i++) {
+		nui_rect *o = &p->rendered[i];
+		if (o->top == rect->top && o->bottom == rect->bottom
+			&& o->left <= rect->right && rect->left <= o->right) {
+			o->left = nui_min(o->left, rect->left);
+			o->right = nui_max(o->right, rect->right);
+			return;
+		}
+		if (o->left == rect->left && o->right == rect->right
+			&& o->top <= rect->bottom && rect->top <= o->bottom) {
+			o->top = nui_min(o->top, rect->top);
+			o->bottom = nui_max(o->bottom, rect->bottom);
+			return;
+		}
+	}
+
+	if (p->num_rendered < NUI_SOFT_PROGRESS_RECTS) {
+		p->rendered[p->num_rendered++] = *rect;
+	} else {
+		nui_rect *last = &p->rendered[NUI_SOFT_PROGRESS_RECTS - 1];
+		last->left = nui_min(last->left, rect->left);
+		last->top = nui_min(last->top, rect->top);
+		last->right = nui_max(last->right, rect->right);
+		last->bottom = nui_max(last->bottom, rect->bottom);
+	}
+}
+
+int nui_soft_render_progressive(nui_surface *dst, const nui_render_info *ri, const nui_point *focus, uint32_t budget_us, nui_soft_progress *progress)
+{
+	nui_soft_renderer *r = (nui_soft_renderer*)nui_layer_renderer(ri->layer);
+	uint64_t begin = nui_trace_time();
+
+	nui_soft_target t;
+	init_target(r, &t, dst);
+	r->pass++;
+
+	nui_rect area;
+	area.min = nui_offset(ri->clip.min, ri->offset);
+	area.max = nui_offset(ri->clip.max, ri->offset);
+
+	nui_rect damage[NUI_MAX_STALE];
+	uint32_t num_damage = 0;
+	if (clip_rect(&area, &t.bounds)) {
+		num_damage = nui_layer_damage(ri->layer, damage, NUI_MAX_STALE);
+	}
+	nui_clear_stale(ri->layer);
+
+	// Split the damage along a fixed grid so leftovers of neighbouring
+	// rects line up and join in the stale list
+	const int32_t size = NUI_SOFT_PROGRESS_TILE;
+	uint32_t num_tiles = 0;
+	for (uint32_t i = 0; i < num_damage; i++) {
+		nui_rect rect;
+		rect.min = nui_offset(damage[i].min, ri->offset);
+		rect.max = nui_offset(damage[i].max, ri->offset);
+		if (!clip_rect(&rect, &area)) continue;
+
+		for (int32_t y = rect.top - rect.top % size; y < rect.bottom; y += size) {
+			for (int32_t x = rect.left - rect.left % size; x < rect.right; x += size) {
+				nui_buf_grow_uninit(&r->tiles, &r->cap_tiles, num_tiles + 1);
+				nui_soft_tile *tile = &r->tiles[num_tiles++];
+				tile->rect.left = nui_max(x, rect.left);
+				tile->rect.top = nui_max(y, rect.top);
+				tile->rect.right = nui_min(x + size, rect.right);
+				tile->rect.bottom = nui_min(y + size, rect.bottom);
+				tile->priority = focus ? tile_distance(&tile->rect, *focus) : 0;
+			}
+		}
+	}
+	qsort(r->tiles, num_tiles, sizeof(nui_soft_tile), &compare_tiles);
+
+	nui_soft_progress p;
+	memset(&p, 0, sizeof(p));
+	p.num_tiles = num_tiles;
+
+	nui_trace_begin(progressive);
+
+	uint32_t ix = 0;
+	for (; ix < num_tiles; ix++) {
+		if (ix > 0 && nui_trace_ticks_to_us(nui_trace_time() - begin) >= (double)budget_us) break;
+
+		nui_rect rect = r->tiles[ix].rect;
+		nui_rect local;
+		local.min = nui_pt(rect.left - ri->offset.x, rect.top - ri->offset.y);
+		local.max = nui_pt(rect.right - ri->offset.x, rect.bottom - ri->offset.y);
+		render_area(r, &t, ri, &local);
+		add_rendered(&p, &rect);
+	}
+
+	for (; ix < num_tiles; ix++) {
+		nui_rect rect = r->tiles[ix].rect;
+		nui_rect local;
+		local.min = nui_pt(rect.left - ri->offset.x, rect.top - ri->offset.y);
+		local.max = nui_pt(rect.right - ri->offset.x, rect.bottom - ri->offset.y);
+		nui_add_stale(ri->layer, &local);
+		p.num_stale_tiles++;
+	}
+
+	nui_trace_end_arg(progressive, "soft_render_progressive", "layer", nui_layer_index(ri->layer));
+
+	int complete = p.num_stale_tiles == 0;
+	if (complete && r->verify_fn) {
+		verify_render(r, &t, ri);
+	}
+
+	if (progress) *progress = p;
+	return complete;
+}
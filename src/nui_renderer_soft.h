@@ -0,0 +1,134 @@
+#pragma once
+
+#include "nui_canvas.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Multi-byte formats are stored as little-endian words, eg. `nui_pf_bgra8`
+// is bytes B, G, R, A in memory. Color channels are not premultiplied.
+typedef enum nui_pixel_format {
+	nui_pf_bgra8,
+	nui_pf_rgba8,
+	nui_pf_rgb565,
+	nui_pf_a8,
+
+	nui_pixel_formats,
+} nui_pixel_format;
+
+typedef struct nui_surface {
+	void *pixels;
+	int32_t width, height;
+	int32_t stride; // In bytes
+	nui_pixel_format format;
+} nui_surface;
+
+typedef struct nui_soft_glyph {
+	int32_t advance;
+	int32_t x, y; // Bitmap offset from the pen position at the top of the line
+	int32_t width, height;
+	const uint8_t *coverage; // `width * height` bytes
+} nui_soft_glyph;
+
+// Glyph rasterizer for the software renderer, results are cached by the
+// renderer so `rasterize()` is called once per font and codepoint.
+typedef struct nui_soft_font_source nui_soft_font_source;
+struct nui_soft_font_source {
+	// Returns the line height
+	int32_t (*load_font)(nui_soft_font_source *s, uint32_t font, const nui_font_desc *desc);
+	// `glyph->coverage` needs to stay valid only until the next call
+	int (*rasterize)(nui_soft_font_source *s, uint32_t font, uint32_t codepoint, nui_soft_glyph *glyph);
+	void (*free)(nui_soft_font_source *s);
+};
+
+uint32_t nui_pixel_size(nui_pixel_format format);
+
+// `fonts` may be NULL for a headless renderer that only lays out text.
+// The renderer takes ownership of `fonts`.
+nui_renderer *nui_soft_renderer_make(nui_soft_font_source *fonts);
+
+// Persistent glyph cache for faster cold starts. Metrics and coverage for
+// known font families and heights are read from the memory mapped file at
+// `path` and `load_font()` is deferred until a glyph is missing. The file is
+// extended with new glyphs and replaced atomically when the renderer is
+// freed. `version` identifies the font source, on mismatch the file is
+// rebuilt. Call before making any fonts, returns zero if nothing was loaded.
+int nui_soft_set_glyph_cache(nui_renderer *r, const char *path, uint32_t version);
+
+// Blend in linear light instead of directly on the sRGB values. Gives
+// correct anti-aliasing and translucency at some cost, opaque pixels are
+// unaffected. Off by default.
+void nui_soft_set_linear_blending(nui_renderer *r, int linear);
+
+// Renders the areas left stale by `nui_soft_render_progressive()` first
+void nui_soft_render(nui_surface *dst, const nui_render_info *ri);
+
+// Progressive rendering for invalidations too large for one frame, eg. a
+// window resize on slow hardware. The damage of `ri->layer` is split into
+// tiles which are redrawn nearest to `focus` first (top to bottom if NULL)
+// until `budget_us` microseconds have passed, at least one tile is always
+// rendered. Tiles that didn't fit are added to the stale areas of
+// `ri->layer` (see `nui_add_stale()`) so the next call continues with them
+// even if nothing else changed. Returns nonzero when the frame is complete.
+//
+//   nui_begin_rendering(c);
+//   int done = nui_soft_render_progressive(dst, &ri, &focus, 4000, &progress);
+//   nui_end_rendering(c);
+//   present(dst, progress.rendered, progress.num_rendered);
+//   if (!done) request_frame();
+
+#define NUI_SOFT_PROGRESS_TILE 128
+#define NUI_SOFT_PROGRESS_RECTS 16
+
+typedef struct nui_soft_progress {
+	// Areas rendered by this call in surface coordinates, adjacent tiles
+	// are joined and rects past the maximum merged into the last one
+	nui_rect rendered[NUI_SOFT_PROGRESS_RECTS];
+	uint32_t num_rendered;
+
+	uint32_t num_tiles;       // Damaged tiles at the start of the call
+	uint32_t num_stale_tiles; // Tiles left for later calls
+} nui_soft_progress;
+
+int nui_soft_render_progressive(nui_surface *dst, const nui_render_info *ri, const nui_point *focus, uint32_t budget_us, nui_soft_progress *progress);
+
+// Verification mode for invalidation and reuse bugs. Every
+// `nui_soft_render()` and every completed progressive frame is followed by
+// a full redraw of the same area into a scratch surface, if the two differ
+// `fn` is called with the details and `dst` is overwritten with the full
+// redraw so each bug is reported once. Roughly doubles the rendering cost,
+// pass NULL to turn off.
+
+#define NUI_SOFT_MISMATCH_DRAWS 8
+#define NUI_SOFT_MISMATCH_DAMAGE 8
+
+typedef struct nui_soft_mismatch {
+	nui_point pixel; // First differing pixel in surface coordinates
+	nui_rect diff;   // Bounds of all differing pixels
+	nui_color actual, expected;
+
+	// Layers at `pixel` starting from the rendered one
+	nui_hit hit;
+
+	// Draws of the innermost layer covering `hit.point`, topmost last
+	const nui_draw *draws[NUI_SOFT_MISMATCH_DRAWS];
+	uint32_t num_draws;
+
+	// `nui_layer_damage()` of the rendered layer
+	nui_rect damage[NUI_SOFT_MISMATCH_DAMAGE];
+	uint32_t num_damage;
+} nui_soft_mismatch;
+
+typedef void nui_soft_verify_fn(void *user, const nui_soft_mismatch *mismatch);
+void nui_soft_set_verify(nui_renderer *r, nui_soft_verify_fn *fn, void *user);
+
+// Human readable report, returns the length like `snprintf()`
+int nui_soft_format_mismatch(char *buf, size_t size, const nui_soft_mismatch *mismatch);
+
+// Present-time conversion of `rect` (NULL for everything) between formats
+void nui_soft_convert(nui_surface *dst, const nui_surface *src, const nui_rect *rect);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,380 @@
+#if defined(__linux__)
+
+#ifndef _GNU_SOURCE
+	#define _GNU_SOURCE
+#endif
+
+#include "nui_shm.h"
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+typedef enum nui_shm_msg_type {
+	nui_shm_msg_setup,
+	nui_shm_msg_frame,
+	nui_shm_msg_release,
+} nui_shm_msg_type;
+
+typedef struct nui_shm_msg {
+	uint32_t type;
+	uint32_t buffer;
+	uint64_t frame;
+
+	// nui_shm_msg_setup
+	int32_t width, height, stride;
+	uint32_t format;
+	uint32_t num_buffers;
+	uint32_t buffer_size;
+
+	// nui_shm_msg_frame
+	uint32_t num_damage;
+	nui_rect damage[NUI_SHM_MAX_DAMAGE];
+} nui_shm_msg;
+
+typedef struct nui_shm_buffer {
+	nui_surface surface;
+	int busy; // Held by the consumer
+
+	// Presented from other buffers since this one was last written
+	nui_rect pending[NUI_SHM_MAX_DAMAGE];
+	uint32_t num_pending;
+} nui_shm_buffer;
+
+struct nui_shm_producer {
+	int socket;
+	int fd;
+	void *memory;
+	size_t size;
+
+	nui_shm_buffer buffers[NUI_SHM_MAX_BUFFERS];
+	uint32_t num_buffers;
+
+	int32_t acquired;
+	int32_t last;
+	uint64_t frame;
+};
+
+struct nui_shm_consumer {
+	int socket;
+	int fd;
+	void *memory;
+	size_t size;
+
+	nui_surface surfaces[NUI_SHM_MAX_BUFFERS];
+	uint32_t num_buffers;
+};
+
+static void add_rect(nui_rect *rects, uint32_t max_rects, uint32_t *p_num, const nui_rect *r)
+{
+	uint32_t num = *p_num;
+	if (num < max_rects) {
+		rects[num] = *r;
+		*p_num = num + 1;
+	} else {
+		nui_rect *last = &rects[max_rects - 1];
+		last->left = nui_min(last->left, r->left);
+		last->top = nui_min(last->top, r->top);
+		last->right = nui_max(last->right, r->right);
+		last->bottom = nui_max(last->bottom, r->bottom);
+	}
+}
+
+static int send_msg(int socket, const nui_shm_msg *msg, int fd)
+{
+	struct iovec iov;
+	iov.iov_base = (void*)msg;
+	iov.iov_len = sizeof(nui_shm_msg);
+
+	union {
+		struct cmsghdr hdr;
+		char data[CMSG_SPACE(sizeof(int))];
+	} control;
+
+	struct msghdr mh = { 0 };
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	if (fd >= 0) {
+		memset(&control, 0, sizeof(control));
+		mh.msg_control = control.data;
+		mh.msg_controllen = sizeof(control.data);
+		struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+		cm->cmsg_level = SOL_SOCKET;
+		cm->cmsg_type = SCM_RIGHTS;
+		cm->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cm), &fd, sizeof(int));
+	}
+
+	ssize_t res;
+	do {
+		res = sendmsg(socket, &mh, MSG_NOSIGNAL);
+	} while (res < 0 && errno == EINTR);
+	return res == (ssize_t)sizeof(nui_shm_msg);
+}
+
+// Returns 1 for a message, 0 if non-blocking and nothing is queued, -1 on error
+static int recv_msg(int socket, nui_shm_msg *msg, int *p_fd, int flags)
+{
+	struct iovec iov;
+	iov.iov_base = msg;
+	iov.iov_len = sizeof(nui_shm_msg);
+
+	union {
+		struct cmsghdr hdr;
+		char data[CMSG_SPACE(sizeof(int))];
+	} control;
+
+	struct msghdr mh = { 0 };
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = control.data;
+	mh.msg_controllen = sizeof(control.data);
+
+	ssize_t res;
+	do {
+		res = recvmsg(socket, &mh, flags | MSG_CMSG_CLOEXEC);
+	} while (res < 0 && errno == EINTR);
+
+	if (res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+	if (res != (ssize_t)sizeof(nui_shm_msg)) return -1;
+
+	if (p_fd) {
+		*p_fd = -1;
+		struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+		if (cm && cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS) {
+			memcpy(p_fd, CMSG_DATA(cm), sizeof(int));
+		}
+	}
+	return 1;
+}
+
+// nui_shm_producer
+
+nui_shm_producer *nui_make_shm_producer(int socket, nui_extent size, nui_pixel_format format, uint32_t num_buffers)
+{
+	nui_assert(num_buffers >= 2 && num_buffers <= NUI_SHM_MAX_BUFFERS);
+
+	int32_t stride = (int32_t)((size.x * nui_pixel_size(format) + 63u) & ~63u);
+	size_t buffer_size = ((size_t)stride * size.y + 4095u) & ~(size_t)4095u;
+
+	int fd = memfd_create("nui_shm", MFD_CLOEXEC);
+	if (fd < 0) return NULL;
+	if (ftruncate(fd, (off_t)(buffer_size * num_buffers)) != 0) {
+		close(fd);
+		return NULL;
+	}
+
+	void *memory = mmap(NULL, buffer_size * num_buffers, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (memory == MAP_FAILED) {
+		close(fd);
+		return NULL;
+	}
+
+	nui_shm_producer *p = nui_make(nui_shm_producer);
+	p->socket = socket;
+	p->fd = fd;
+	p->memory = memory;
+	p->size = buffer_size * num_buffers;
+	p->num_buffers = num_buffers;
+	p->acquired = -1;
+	p->last = -1;
+
+	for (uint32_t i = 0; i < num_buffers; i++) {
+		nui_surface *s = &p->buffers[i].surface;
+		s->pixels = (char*)memory + buffer_size * i;
+		s->width = size.x;
+		s->height = size.y;
+		s->stride = stride;
+		s->format = format;
+	}
+
+	nui_shm_msg msg = { 0 };
+	msg.type = nui_shm_msg_setup;
+	msg.width = size.x;
+	msg.height = size.y;
+	msg.stride = stride;
+	msg.format = (uint32_t)format;
+	msg.num_buffers = num_buffers;
+	msg.buffer_size = (uint32_t)buffer_size;
+	if (!send_msg(socket, &msg, fd)) {
+		nui_free_shm_producer(p);
+		return NULL;
+	}
+
+	return p;
+}
+
+void nui_free_shm_producer(nui_shm_producer *p)
+{
+	if (p == NULL) return;
+	munmap(p->memory, p->size);
+	close(p->fd);
+	nui_free(p);
+}
+
+static int handle_release(nui_shm_producer *p, const nui_shm_msg *msg)
+{
+	if (msg->type != nui_shm_msg_release || msg->buffer >= p->num_buffers) return 0;
+	p->buffers[msg->buffer].busy = 0;
+	return 1;
+}
+
+static int32_t find_free_buffer(nui_shm_producer *p)
+{
+	// Prefer the buffer presented longest ago, ie. the next one in the ring
+	for (uint32_t i = 1; i <= p->num_buffers; i++) {
+		uint32_t ix = (uint32_t)(p->last + (int32_t)i) % p->num_buffers;
+		if (!p->buffers[ix].busy) return (int32_t)ix;
+	}
+	return -1;
+}
+
+nui_surface *nui_shm_acquire(nui_shm_producer *p)
+{
+	nui_assert(p->acquired < 0);
+
+	nui_shm_msg msg;
+	int res;
+	while ((res = recv_msg(p->socket, &msg, NULL, MSG_DONTWAIT)) > 0) {
+		handle_release(p, &msg);
+	}
+	if (res < 0) return NULL;
+
+	int32_t ix;
+	while ((ix = find_free_buffer(p)) < 0) {
+		if (recv_msg(p->socket, &msg, NULL, 0) <= 0) return NULL;
+		handle_release(p, &msg);
+	}
+
+	// Catch up with the frames presented from other buffers
+	nui_shm_buffer *b = &p->buffers[ix];
+	if (p->last >= 0 && p->last != ix) {
+		nui_surface *src = &p->buffers[p->last].surface;
+		for (uint32_t i = 0; i < b->num_pending; i++) {
+			nui_soft_convert(&b->surface, src, &b->pending[i]);
+		}
+	}
+	b->num_pending = 0;
+
+	p->acquired = ix;
+	return &b->surface;
+}
+
+int nui_shm_present(nui_shm_producer *p, const nui_rect *damage, uint32_t num_damage)
+{
+	nui_assert(p->acquired >= 0);
+	int32_t ix = p->acquired;
+
+	nui_shm_msg msg = { 0 };
+	msg.type = nui_shm_msg_frame;
+	msg.buffer = (uint32_t)ix;
+	msg.frame = ++p->frame;
+	for (uint32_t i = 0; i < num_damage; i++) {
+		add_rect(msg.damage, NUI_SHM_MAX_DAMAGE, &msg.num_damage, &damage[i]);
+	}
+
+	for (uint32_t bi = 0; bi < p->num_buffers; bi++) {
+		if ((int32_t)bi == ix) continue;
+		nui_shm_buffer *b = &p->buffers[bi];
+		for (uint32_t i = 0; i < msg.num_damage; i++) {
+			add_rect(b->pending, NUI_SHM_MAX_DAMAGE, &b->num_pending, &msg.damage[i]);
+		}
+	}
+
+	p->buffers[ix].busy = 1;
+	p->last = ix;
+	p->acquired = -1;
+
+	return send_msg(p->socket, &msg, -1);
+}
+
+// nui_shm_consumer
+
+// The setup comes from another process, every buffer it describes must lie
+// inside the shared memory
+static int valid_setup(const nui_shm_msg *msg, int fd)
+{
+	if (msg->type != nui_shm_msg_setup || fd < 0) return 0;
+	if (msg->num_buffers < 1 || msg->num_buffers > NUI_SHM_MAX_BUFFERS) return 0;
+	if (msg->format >= nui_pixel_formats) return 0;
+	if (msg->width < 0 || msg->height < 0 || msg->stride < 0) return 0;
+	if ((int64_t)msg->stride < (int64_t)msg->width * nui_pixel_size((nui_pixel_format)msg->format)) return 0;
+	if ((uint64_t)msg->stride * (uint64_t)msg->height > msg->buffer_size) return 0;
+
+	struct stat st;
+	if (fstat(fd, &st) != 0) return 0;
+	return (uint64_t)st.st_size >= (uint64_t)msg->buffer_size * msg->num_buffers;
+}
+
+nui_shm_consumer *nui_make_shm_consumer(int socket)
+{
+	nui_shm_msg msg;
+	int fd = -1;
+	if (recv_msg(socket, &msg, &fd, 0) <= 0) return NULL;
+	if (!valid_setup(&msg, fd)) {
+		if (fd >= 0) close(fd);
+		return NULL;
+	}
+
+	size_t size = (size_t)msg.buffer_size * msg.num_buffers;
+	void *memory = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	if (memory == MAP_FAILED) {
+		close(fd);
+		return NULL;
+	}
+
+	nui_shm_consumer *c = nui_make(nui_shm_consumer);
+	c->socket = socket;
+	c->fd = fd;
+	c->memory = memory;
+	c->size = size;
+	c->num_buffers = msg.num_buffers;
+
+	for (uint32_t i = 0; i < msg.num_buffers; i++) {
+		nui_surface *s = &c->surfaces[i];
+		s->pixels = (char*)memory + (size_t)msg.buffer_size * i;
+		s->width = msg.width;
+		s->height = msg.height;
+		s->stride = msg.stride;
+		s->format = (nui_pixel_format)msg.format;
+	}
+
+	return c;
+}
+
+void nui_free_shm_consumer(nui_shm_consumer *c)
+{
+	if (c == NULL) return;
+	munmap(c->memory, c->size);
+	close(c->fd);
+	nui_free(c);
+}
+
+int nui_shm_receive(nui_shm_consumer *c, nui_shm_frame *frame)
+{
+	nui_shm_msg msg;
+	for (;;) {
+		if (recv_msg(c->socket, &msg, NULL, 0) <= 0) return 0;
+		if (msg.type == nui_shm_msg_frame && msg.buffer < c->num_buffers) break;
+	}
+
+	frame->frame = msg.frame;
+	frame->buffer = msg.buffer;
+	frame->surface = c->surfaces[msg.buffer];
+	frame->num_damage = nui_min(msg.num_damage, NUI_SHM_MAX_DAMAGE);
+	memcpy(frame->damage, msg.damage, frame->num_damage * sizeof(nui_rect));
+	return 1;
+}
+
+int nui_shm_release(nui_shm_consumer *c, const nui_shm_frame *frame)
+{
+	nui_shm_msg msg = { 0 };
+	msg.type = nui_shm_msg_release;
+	msg.buffer = frame->buffer;
+	msg.frame = frame->frame;
+	return send_msg(c->socket, &msg, -1);
+}
+
+#endif
@@ -0,0 +1,48 @@
+#pragma once
+
+#include "nui_renderer_soft.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Zero-copy presentation to another process (Linux only). The producer
+// renders into a ring of memfd-backed surfaces shared with the consumer,
+// frames and buffer releases are sent as messages over a local
+// SOCK_SEQPACKET socket, eg. one end of `socketpair()`.
+
+#define NUI_SHM_MAX_BUFFERS 4
+#define NUI_SHM_MAX_DAMAGE 16
+
+typedef struct nui_shm_producer nui_shm_producer;
+typedef struct nui_shm_consumer nui_shm_consumer;
+
+typedef struct nui_shm_frame {
+	uint64_t frame;
+	uint32_t buffer;
+	nui_surface surface; // Points to shared memory, valid until released
+	nui_rect damage[NUI_SHM_MAX_DAMAGE];
+	uint32_t num_damage;
+} nui_shm_frame;
+
+nui_shm_producer *nui_make_shm_producer(int socket, nui_extent size, nui_pixel_format format, uint32_t num_buffers);
+void nui_free_shm_producer(nui_shm_producer *p);
+
+// Wait for a buffer released by the consumer. The buffer contents are
+// brought up to date with the last presented frame by copying only the
+// areas damaged since it was last used, so rendering can be incremental.
+nui_surface *nui_shm_acquire(nui_shm_producer *p);
+
+// Present the acquired buffer, `damage` is usually from `nui_layer_damage()`
+int nui_shm_present(nui_shm_producer *p, const nui_rect *damage, uint32_t num_damage);
+
+nui_shm_consumer *nui_make_shm_consumer(int socket);
+void nui_free_shm_consumer(nui_shm_consumer *c);
+
+// Block until the next frame, the previous frame should be released first
+int nui_shm_receive(nui_shm_consumer *c, nui_shm_frame *frame);
+int nui_shm_release(nui_shm_consumer *c, const nui_shm_frame *frame);
+
+#ifdef __cplusplus
+}
+#endif
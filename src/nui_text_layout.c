@@ -0,0 +1,490 @@
+#include "nui_text_layout.h"
+
+// Word width cache is flushed instead of grown past this
+#define NUI_TEXT_MAX_WORDS (64 * 1024)
+
+typedef struct nui_text_line {
+	uint32_t begin, end;
+	int32_t width;
+} nui_text_line;
+
+// Text between hard line breaks, laid out independently of others
+typedef struct nui_text_para {
+	char *text;
+	uint32_t len, cap;
+
+	nui_text_line *lines;
+	uint32_t num_lines, cap_lines;
+	int32_t max_width;
+
+	size_t begin;        // Valid below `nui_text_layout.offsets_valid`
+	uint32_t first_line; // Valid below `nui_text_layout.lines_valid`
+	int dirty;
+} nui_text_para;
+
+typedef struct nui_text_word {
+	uint64_t hash;
+	uint32_t len; // Zero for empty slots
+	int32_t width;
+} nui_text_word;
+
+struct nui_text_layout {
+	nui_font *font;
+	int32_t width;
+	int32_t line_height;
+	int32_t space_width;
+
+	nui_text_para *paras;
+	uint32_t num_paras, cap_paras;
+	size_t total_len;
+
+	uint32_t offsets_valid, lines_valid;
+	uint32_t dirty_begin, dirty_end;
+
+	nui_text_word *words;
+	uint32_t num_words, cap_words;
+
+	// Scratch for measuring the new words of a paragraph in one batch
+	const char **batch_texts;
+	size_t *batch_lens;
+	nui_extent *batch_extents;
+	uint32_t cap_batch_texts, cap_batch_lens, cap_batch_extents;
+
+	int32_t *advances; // Prefix widths of a word broken across lines
+	uint32_t cap_advances;
+};
+
+static uint32_t utf8_size(char c)
+{
+	uint8_t b = (uint8_t)c;
+	if (b < 0xc0) return 1;
+	if (b < 0xe0) return 2;
+	if (b < 0xf0) return 3;
+	return 4;
+}
+
+static uint64_t hash_bytes(const char *s, uint32_t len)
+{
+	uint64_t h = 0xcbf29ce484222325u;
+	for (uint32_t i = 0; i < len; i++) {
+		h = (h ^ (uint8_t)s[i]) * 0x100000001b3u;
+	}
+	return h;
+}
+
+// Word widths
+
+static void insert_word(nui_text_layout *t, nui_text_word word)
+{
+	uint32_t mask = t->cap_words - 1;
+	uint32_t ix = (uint32_t)word.hash & mask;
+	while (t->words[ix].len != 0) {
+		ix = (ix + 1) & mask;
+	}
+	t->words[ix] = word;
+	t->num_words++;
+}
+
+static void reserve_word(nui_text_layout *t)
+{
+	if (t->num_words >= NUI_TEXT_MAX_WORDS) {
+		memset(t->words, 0, t->cap_words * sizeof(nui_text_word));
+		t->num_words = 0;
+	}
+	if ((t->num_words + 1) * 4 <= t->cap_words * 3) return;
+
+	nui_text_word *old = t->words;
+	uint32_t old_cap = t->cap_words;
+	t->cap_words = old_cap ? old_cap * 2 : 256;
+	t->words = (nui_text_word*)nui_alloc(t->cap_words * sizeof(nui_text_word));
+	t->num_words = 0;
+	for (uint32_t i = 0; i < old_cap; i++) {
+		if (old[i].len != 0) insert_word(t, old[i]);
+	}
+	nui_free(old);
+}
+
+static const nui_text_word *find_word(const nui_text_layout *t, uint64_t hash, uint32_t len)
+{
+	if (t->cap_words == 0) return NULL;
+	uint32_t mask = t->cap_words - 1;
+	for (uint32_t ix = (uint32_t)hash & mask; t->words[ix].len != 0; ix = (ix + 1) & mask) {
+		const nui_text_word *w = &t->words[ix];
+		if (w->hash == hash && w->len == len) return w;
+	}
+	return NULL;
+}
+
+static void add_word(nui_text_layout *t, uint64_t hash, uint32_t len, int32_t width)
+{
+	nui_text_word word;
+	word.hash = hash;
+	word.len = len;
+	word.width = width;
+	reserve_word(t);
+	insert_word(t, word);
+}
+
+static int32_t word_width(nui_text_layout *t, const char *s, uint32_t len)
+{
+	uint64_t hash = hash_bytes(s, len);
+	const nui_text_word *w = find_word(t, hash, len);
+	if (w) return w->width;
+
+	int32_t width = nui_measure_len(t->font, s, len).x;
+	add_word(t, hash, len, width);
+	return width;
+}
+
+// Measure the words of `text` missing from the cache with a single call
+static void measure_new_words(nui_text_layout *t, const char *text, uint32_t len)
+{
+	uint32_t count = 0;
+	for (uint32_t i = 0; i < len; ) {
+		while (i < len && text[i] == ' ') i++;
+		uint32_t begin = i;
+		while (i < len && text[i] != ' ') i++;
+		if (i == begin || find_word(t, hash_bytes(text + begin, i - begin), i - begin)) continue;
+
+		nui_buf_grow_uninit(&t->batch_texts, &t->cap_batch_texts, count + 1);
+		nui_buf_grow_uninit(&t->batch_lens, &t->cap_batch_lens, count + 1);
+		t->batch_texts[count] = text + begin;
+		t->batch_lens[count] = i - begin;
+		count++;
+	}
+	if (count == 0) return;
+
+	nui_buf_grow_uninit(&t->batch_extents, &t->cap_batch_extents, count);
+	nui_measure_many(t->font, t->batch_texts, t->batch_lens, count, t->batch_extents);
+	for (uint32_t i = 0; i < count; i++) {
+		uint32_t wlen = (uint32_t)t->batch_lens[i];
+		uint64_t hash = hash_bytes(t->batch_texts[i], wlen);
+		if (find_word(t, hash, wlen)) continue; // Repeated within the batch
+		add_word(t, hash, wlen, t->batch_extents[i].x);
+	}
+}
+
+// Layout
+
+static void push_line(nui_text_para *p, uint32_t begin, uint32_t end, int32_t width)
+{
+	nui_buf_grow(&p->lines, &p->cap_lines, p->num_lines + 1);
+	nui_text_line *line = &p->lines[p->num_lines++];
+	line->begin = begin;
+	line->end = end;
+	line->width = width;
+	if (width > p->max_width) p->max_width = width;
+}
+
+static void layout_para(nui_text_layout *t, nui_text_para *p)
+{
+	const char *text = p->text;
+	uint32_t len = p->len;
+	int32_t width = t->width;
+	int wrap = width > 0;
+
+	p->num_lines = 0;
+	p->max_width = 0;
+
+	measure_new_words(t, text, len);
+
+	uint32_t line_begin = 0, line_end = 0;
+	int32_t x = 0;
+	uint32_t i = 0;
+	while (i < len) {
+		uint32_t word_begin = i;
+		while (word_begin < len && text[word_begin] == ' ') word_begin++;
+		uint32_t word_end = word_begin;
+		while (word_end < len && text[word_end] != ' ') word_end++;
+		if (word_end == word_begin) break;
+
+		int32_t space_w = (int32_t)(word_begin - i) * t->space_width;
+		int32_t w = word_width(t, text + word_begin, word_end - word_begin);
+
+		if (wrap && line_end > line_begin && x + space_w + w > width) {
+			push_line(p, line_begin, line_end, x);
+			line_begin = word_begin;
+			x = 0;
+			space_w = 0;
+		}
+
+		if (wrap && x + space_w + w > width) {
+			// Word doesn't fit on a line by itself, break between codepoints
+			x += space_w;
+			uint32_t word_len = word_end - word_begin;
+			nui_buf_grow_uninit(&t->advances, &t->cap_advances, word_len);
+			nui_measure_prefixes(t->font, text + word_begin, word_len, t->advances);
+			const int32_t *adv = t->advances;
+			for (uint32_t c = word_begin; c < word_end; ) {
+				uint32_t size = nui_min(utf8_size(text[c]), word_end - c);
+				uint32_t offset = c - word_begin;
+				int32_t cw = adv[offset + size - 1] - (offset > 0 ? adv[offset - 1] : 0);
+				if (c > line_begin && x + cw > width) {
+					push_line(p, line_begin, c, x);
+					line_begin = c;
+					x = 0;
+				}
+				x += cw;
+				c += size;
+			}
+		} else {
+			x += space_w + w;
+		}
+
+		line_end = word_end;
+		i = word_end;
+	}
+
+	push_line(p, line_begin, line_end, x);
+}
+
+static void mark_dirty(nui_text_layout *t, uint32_t begin, uint32_t end)
+{
+	for (uint32_t i = begin; i < end; i++) {
+		t->paras[i].dirty = 1;
+	}
+	if (t->dirty_begin == t->dirty_end) {
+		t->dirty_begin = begin;
+		t->dirty_end = end;
+	} else {
+		t->dirty_begin = nui_min(t->dirty_begin, begin);
+		t->dirty_end = nui_max(t->dirty_end, end);
+	}
+}
+
+static void update_offsets(nui_text_layout *t)
+{
+	uint32_t i = t->offsets_valid;
+	if (i == 0) {
+		t->paras[0].begin = 0;
+		i = 1;
+	}
+	for (; i < t->num_paras; i++) {
+		nui_text_para *prev = &t->paras[i - 1];
+		t->paras[i].begin = prev->begin + prev->len + 1;
+	}
+	t->offsets_valid = t->num_paras;
+}
+
+static uint32_t find_para_at_offset(nui_text_layout *t, size_t pos)
+{
+	uint32_t lo = 0, hi = t->num_paras;
+	while (hi - lo > 1) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (t->paras[mid].begin <= pos) lo = mid;
+		else hi = mid;
+	}
+	return lo;
+}
+
+static uint32_t find_para_at_line(nui_text_layout *t, uint32_t line)
+{
+	uint32_t lo = 0, hi = t->num_paras;
+	while (hi - lo > 1) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (t->paras[mid].first_line <= line) lo = mid;
+		else hi = mid;
+	}
+	return lo;
+}
+
+static void para_append(nui_text_para *p, const char *text, size_t len)
+{
+	if (len == 0) return;
+	nui_buf_grow_uninit(&p->text, &p->cap, p->len + (uint32_t)len);
+	memcpy(p->text + p->len, text, len);
+	p->len += (uint32_t)len;
+}
+
+static void free_para(nui_text_para *p)
+{
+	nui_free(p->text);
+	nui_free(p->lines);
+}
+
+nui_text_layout *nui_make_text_layout(nui_font *font)
+{
+	nui_text_layout *t = nui_make(nui_text_layout);
+	t->font = font;
+
+	nui_extent space = nui_measure_len(font, " ", 1);
+	t->space_width = space.x;
+	t->line_height = space.y;
+
+	nui_buf_grow(&t->paras, &t->cap_paras, 1);
+	t->num_paras = 1;
+	mark_dirty(t, 0, 1);
+
+	return t;
+}
+
+void nui_free_text_layout(nui_text_layout *t)
+{
+	if (t == NULL) return;
+	for (uint32_t i = 0; i < t->num_paras; i++) {
+		free_para(&t->paras[i]);
+	}
+	nui_free(t->paras);
+	nui_free(t->words);
+	nui_free(t->batch_texts);
+	nui_free(t->batch_lens);
+	nui_free(t->batch_extents);
+	nui_free(t->advances);
+	nui_free(t);
+}
+
+void nui_text_set(nui_text_layout *t, const char *text, size_t len)
+{
+	nui_text_replace(t, 0, t->total_len, text, len);
+}
+
+void nui_text_replace(nui_text_layout *t, size_t pos, size_t remove_len, const char *text, size_t len)
+{
+	nui_assert(pos + remove_len <= t->total_len);
+	update_offsets(t);
+
+	uint32_t a = find_para_at_offset(t, pos);
+	uint32_t b = find_para_at_offset(t, pos + remove_len);
+	uint32_t pos_a = (uint32_t)(pos - t->paras[a].begin);
+	uint32_t pos_b = (uint32_t)(pos + remove_len - t->paras[b].begin);
+
+	// Detach the text after the removed range, this may be in `a` itself
+	nui_text_para *pb = &t->paras[b];
+	uint32_t tail_len = pb->len - pos_b;
+	char *tail = (char*)nui_alloc_uninit(tail_len + 1);
+	if (tail_len > 0) memcpy(tail, pb->text + pos_b, tail_len);
+
+	uint32_t num_new = 0;
+	for (size_t i = 0; i < len; i++) {
+		if (text[i] == '\n') num_new++;
+	}
+
+	// Splice paragraphs (a, b] out and `num_new` fresh ones in after `a`
+	for (uint32_t i = a + 1; i <= b; i++) {
+		free_para(&t->paras[i]);
+	}
+	uint32_t num_removed = b - a;
+	uint32_t num_paras = t->num_paras - num_removed + num_new;
+	nui_buf_grow(&t->paras, &t->cap_paras, num_paras);
+	memmove(t->paras + a + 1 + num_new, t->paras + b + 1, (t->num_paras - b - 1) * sizeof(nui_text_para));
+	memset(t->paras + a + 1, 0, num_new * sizeof(nui_text_para));
+	t->num_paras = num_paras;
+
+	nui_text_para *p = &t->paras[a];
+	p->len = pos_a;
+	size_t seg_begin = 0;
+	for (size_t i = 0; i <= len; i++) {
+		if (i < len && text[i] != '\n') continue;
+		para_append(p, text + seg_begin, i - seg_begin);
+		if (i < len) p++;
+		seg_begin = i + 1;
+	}
+	para_append(p, tail, tail_len);
+	nui_free(tail);
+
+	t->total_len = t->total_len - remove_len + len;
+
+	// Shift the pending dirty range over the splice
+	if (t->dirty_end > a + 1) {
+		t->dirty_end = t->dirty_end > b + 1 ? t->dirty_end - num_removed + num_new : a + 1;
+	}
+	mark_dirty(t, a, a + 1 + num_new);
+	t->offsets_valid = nui_min(t->offsets_valid, a + 1);
+	t->lines_valid = nui_min(t->lines_valid, a + 1);
+}
+
+void nui_text_append(nui_text_layout *t, const char *text, size_t len)
+{
+	nui_text_replace(t, t->total_len, 0, text, len);
+}
+
+size_t nui_text_length(const nui_text_layout *t)
+{
+	return t->total_len;
+}
+
+void nui_text_set_width(nui_text_layout *t, int32_t width)
+{
+	if (width <= 0) width = 0;
+	if (width == t->width) return;
+	t->width = width;
+	mark_dirty(t, 0, t->num_paras);
+}
+
+void nui_text_update(nui_text_layout *t)
+{
+	for (uint32_t i = t->dirty_begin; i < t->dirty_end; i++) {
+		nui_text_para *p = &t->paras[i];
+		if (!p->dirty) continue;
+		uint32_t num_lines = p->num_lines;
+		layout_para(t, p);
+		p->dirty = 0;
+
+		if (p->num_lines != num_lines) {
+			t->lines_valid = nui_min(t->lines_valid, i + 1);
+		}
+	}
+	t->dirty_begin = t->dirty_end = 0;
+
+	uint32_t i = t->lines_valid;
+	if (i == 0) {
+		t->paras[0].first_line = 0;
+		i = 1;
+	}
+	for (; i < t->num_paras; i++) {
+		nui_text_para *prev = &t->paras[i - 1];
+		t->paras[i].first_line = prev->first_line + prev->num_lines;
+	}
+	t->lines_valid = t->num_paras;
+}
+
+uint32_t nui_text_num_lines(nui_text_layout *t)
+{
+	nui_text_update(t);
+	nui_text_para *last = &t->paras[t->num_paras - 1];
+	return last->first_line + last->num_lines;
+}
+
+int32_t nui_text_line_height(const nui_text_layout *t)
+{
+	return t->line_height;
+}
+
+nui_extent nui_text_extent(nui_text_layout *t)
+{
+	uint32_t num_lines = nui_text_num_lines(t);
+	int32_t width = 0;
+	for (uint32_t i = 0; i < t->num_paras; i++) {
+		width = nui_max(width, t->paras[i].max_width);
+	}
+	return nui_ex(width, (int32_t)num_lines * t->line_height);
+}
+
+void nui_draw_text_layout(nui_layer *l, nui_point pos, nui_text_layout *t, nui_color color, const nui_rect *clip)
+{
+	uint32_t num_lines = nui_text_num_lines(t);
+	int32_t lh = nui_max(t->line_height, 1);
+
+	uint32_t first = 0, last = num_lines;
+	if (clip) {
+		int32_t top = clip->top - pos.y, bottom = clip->bottom - pos.y;
+		if (bottom <= 0) return;
+		first = top > 0 ? (uint32_t)(top / lh) : 0;
+		last = nui_min(last, (uint32_t)((bottom + lh - 1) / lh));
+	}
+	if (first >= last) return;
+
+	uint32_t pi = find_para_at_line(t, first);
+	for (uint32_t line = first; line < last; pi++) {
+		nui_text_para *p = &t->paras[pi];
+		uint32_t li = line - p->first_line;
+		for (; li < p->num_lines && line < last; li++, line++) {
+			nui_text_line *tl = &p->lines[li];
+			if (tl->end == tl->begin) continue;
+
+			nui_point lp = nui_pt(pos.x, pos.y + (int32_t)line * t->line_height);
+			nui_extent extent = nui_ex(tl->width, t->line_height);
+			nui_draw_text_sized(l, lp, t->font, color, p->text + tl->begin, tl->end - tl->begin, extent);
+		}
+	}
+}
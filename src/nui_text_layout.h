@@ -0,0 +1,37 @@
+#pragma once
+
+#include "nui_canvas.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct nui_text_layout nui_text_layout;
+
+nui_text_layout *nui_make_text_layout(nui_font *font);
+void nui_free_text_layout(nui_text_layout *t);
+
+// Editing, `pos` and `remove_len` are byte offsets into the whole UTF-8 text.
+// Only the paragraphs (runs between '\n') touched by an edit are re-laid out.
+void nui_text_set(nui_text_layout *t, const char *text, size_t len);
+void nui_text_replace(nui_text_layout *t, size_t pos, size_t remove_len, const char *text, size_t len);
+void nui_text_append(nui_text_layout *t, const char *text, size_t len);
+size_t nui_text_length(const nui_text_layout *t);
+
+// Wrap width in pixels, zero or negative disables wrapping
+void nui_text_set_width(nui_text_layout *t, int32_t width);
+
+// Re-lay out changed paragraphs, called implicitly by the queries below
+void nui_text_update(nui_text_layout *t);
+
+uint32_t nui_text_num_lines(nui_text_layout *t);
+int32_t nui_text_line_height(const nui_text_layout *t);
+nui_extent nui_text_extent(nui_text_layout *t);
+
+// Record the lines intersecting `clip` (relative to `l`, NULL for all) as
+// `nui_dt_text` draws with the top-left corner at `pos`.
+void nui_draw_text_layout(nui_layer *l, nui_point pos, nui_text_layout *t, nui_color color, const nui_rect *clip);
+
+#ifdef __cplusplus
+}
+#endif
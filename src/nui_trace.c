@@ -0,0 +1,140 @@
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+	#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include "nui_trace.h"
+#include <stdio.h>
+
+#if defined(_WIN32)
+	#define WIN32_LEAN_AND_MEAN
+	#define NOMINMAX
+	#include <Windows.h>
+#else
+	#include <time.h>
+#endif
+
+// Written and read one word at a time with relaxed atomics, `seq` orders
+// them as a sequence lock
+typedef struct nui_trace_event {
+	volatile uint64_t seq; // Index + 1 once the slot is fully written
+	volatile uint64_t name, key; // `const char*`
+	volatile uint64_t begin, end;
+	volatile uint64_t arg_thread; // Argument in the low, thread in the high half
+} nui_trace_event;
+
+#define NUI_TRACE_MASK (NUI_TRACE_CAPACITY - 1)
+
+static nui_trace_event g_trace_events[NUI_TRACE_CAPACITY];
+static volatile uint64_t g_trace_head;
+static volatile uint64_t g_trace_tail;
+static volatile uint64_t g_trace_threads;
+static NUI_THREAD_LOCAL uint32_t t_trace_thread;
+
+uint64_t nui_trace_time(void)
+{
+#if defined(_WIN32)
+	LARGE_INTEGER t;
+	QueryPerformanceCounter(&t);
+	return (uint64_t)t.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+double nui_trace_ticks_to_us(uint64_t ticks)
+{
+#if defined(_WIN32)
+	LARGE_INTEGER freq;
+	QueryPerformanceFrequency(&freq);
+	return (double)ticks * 1e6 / (double)freq.QuadPart;
+#else
+	return (double)ticks * 1e-3;
+#endif
+}
+
+void nui_trace_span(const char *name, const char *key, uint32_t arg, uint64_t begin)
+{
+	uint64_t end = nui_trace_time();
+
+	uint32_t thread = t_trace_thread;
+	if (thread == 0) {
+		thread = (uint32_t)nui_atomic_add64(&g_trace_threads, 1) + 1;
+		t_trace_thread = thread;
+	}
+
+	uint64_t ix = nui_atomic_add64(&g_trace_head, 1);
+	nui_trace_event *e = &g_trace_events[ix & NUI_TRACE_MASK];
+	nui_atomic_store64_relaxed(&e->seq, 0);
+	nui_atomic_fence_release();
+	nui_atomic_store64_relaxed(&e->name, (uint64_t)(uintptr_t)name);
+	nui_atomic_store64_relaxed(&e->key, (uint64_t)(uintptr_t)key);
+	nui_atomic_store64_relaxed(&e->begin, begin);
+	nui_atomic_store64_relaxed(&e->end, end);
+	nui_atomic_store64_relaxed(&e->arg_thread, (uint64_t)thread << 32 | arg);
+	nui_atomic_store64(&e->seq, ix + 1);
+}
+
+void nui_trace_clear(void)
+{
+	nui_atomic_store64(&g_trace_tail, nui_atomic_load64(&g_trace_head));
+}
+
+void nui_trace_dump(nui_trace_write_fn *write, void *user)
+{
+	static const char header[] = "{\"traceEvents\":[\n";
+	static const char footer[] = "\n]}\n";
+	write(user, header, sizeof(header) - 1);
+
+	uint64_t head = nui_atomic_load64(&g_trace_head);
+	uint64_t begin = nui_atomic_load64(&g_trace_tail);
+	if (head - begin > NUI_TRACE_CAPACITY) begin = head - NUI_TRACE_CAPACITY;
+
+	char buf[256];
+	int first = 1;
+	for (uint64_t ix = begin; ix < head; ix++) {
+		nui_trace_event *e = &g_trace_events[ix & NUI_TRACE_MASK];
+		if (nui_atomic_load64(&e->seq) != ix + 1) continue;
+		const char *name = (const char*)(uintptr_t)nui_atomic_load64_relaxed(&e->name);
+		const char *key = (const char*)(uintptr_t)nui_atomic_load64_relaxed(&e->key);
+		uint64_t ev_begin = nui_atomic_load64_relaxed(&e->begin);
+		uint64_t ev_end = nui_atomic_load64_relaxed(&e->end);
+		uint64_t arg_thread = nui_atomic_load64_relaxed(&e->arg_thread);
+		// Skip slots overwritten while copying
+		nui_atomic_fence_acquire();
+		if (nui_atomic_load64_relaxed(&e->seq) != ix + 1) continue;
+
+		uint32_t arg = (uint32_t)arg_thread, thread = (uint32_t)(arg_thread >> 32);
+		double ts = nui_trace_ticks_to_us(ev_begin);
+		double dur = nui_trace_ticks_to_us(ev_end - ev_begin);
+		int len;
+		if (key) {
+			len = snprintf(buf, sizeof(buf),
+				"%s{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%u,\"args\":{\"%s\":%u}}",
+				first ? "" : ",\n", name, ts, dur, thread, key, arg);
+		} else {
+			len = snprintf(buf, sizeof(buf),
+				"%s{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%u}",
+				first ? "" : ",\n", name, ts, dur, thread);
+		}
+		if (len <= 0) continue;
+		write(user, buf, nui_min(len, (int32_t)sizeof(buf) - 1));
+		first = 0;
+	}
+
+	write(user, footer, sizeof(footer) - 1);
+}
+
+static void write_file(void *user, const char *data, size_t size)
+{
+	fwrite(data, 1, size, (FILE*)user);
+}
+
+int nui_trace_dump_file(const char *path)
+{
+	FILE *f = fopen(path, "wb");
+	if (!f) return 0;
+	nui_trace_dump(&write_file, f);
+	return fclose(f) == 0;
+}
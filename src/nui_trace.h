@@ -0,0 +1,48 @@
+#pragma once
+
+#include "nui_base.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Timeline of frame phases exported as Chrome trace JSON (chrome://tracing,
+// Perfetto). Compiled in only with NUI_TRACE defined, otherwise the macros
+// expand to nothing. Spans are written to a fixed size lock-free ring
+// buffer so any thread may record, the oldest spans get overwritten.
+//
+//   nui_trace_begin(draw);
+//   ...
+//   nui_trace_end_arg(draw, "draw", "layer", layer_index);
+
+#define NUI_TRACE_CAPACITY (64 * 1024)
+
+#if defined(NUI_TRACE)
+	#define nui_trace_begin(id) uint64_t nui_trace_t_##id = nui_trace_time()
+	#define nui_trace_end(id, name) nui_trace_span((name), NULL, 0, nui_trace_t_##id)
+	#define nui_trace_end_arg(id, name, key, arg) nui_trace_span((name), (key), (arg), nui_trace_t_##id)
+#else
+	#define nui_trace_begin(id) ((void)0)
+	#define nui_trace_end(id, name) ((void)0)
+	#define nui_trace_end_arg(id, name, key, arg) ((void)0)
+#endif
+
+uint64_t nui_trace_time(void);
+// Duration of a difference of `nui_trace_time()` values
+double nui_trace_ticks_to_us(uint64_t ticks);
+
+// `name` and `key` must be string literals or otherwise outlive the trace,
+// `key` names `arg` in the event and may be NULL for no argument
+void nui_trace_span(const char *name, const char *key, uint32_t arg, uint64_t begin);
+
+void nui_trace_clear(void);
+
+typedef void nui_trace_write_fn(void *user, const char *data, size_t size);
+
+// Write all retained spans as a Chrome trace JSON document
+void nui_trace_dump(nui_trace_write_fn *write, void *user);
+int nui_trace_dump_file(const char *path);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,16 @@
+#pragma once
+
+// Standalone test programs, each built from its own main file and the
+// sources it lists at the top, eg.
+//
+//   cc -std=c11 -Isrc test/test_delta.c src/nui_base.c ... -lm && ./a.out
+//
+// Exit with a non-zero status on the first failed check.
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define CHECK(cond) do { if (!(cond)) { \
+		fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+		exit(1); \
+	} } while (0)
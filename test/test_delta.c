@@ -0,0 +1,170 @@
+// Round trip of the delta encoder and decoder for every pixel format,
+// rejection of truncated and corrupted streams without touching the
+// destination, and a rough encode/decode benchmark.
+//
+//   cc -std=c11 -O2 -Isrc test/test_delta.c src/nui_base.c src/nui_canvas.c
+//      src/nui_renderer_soft.c src/nui_delta.c src/nui_trace.c -lm
+
+#include "test.h"
+#include "nui_delta.h"
+#include "nui_trace.h"
+#include <string.h>
+
+#define WIDTH 333
+#define HEIGHT 201
+
+static uint32_t g_random = 1;
+
+static uint32_t next_random(void)
+{
+	g_random = g_random * 1664525u + 1013904223u;
+	return g_random >> 8;
+}
+
+static void fill(nui_surface *s, const nui_rect *r, uint32_t pattern)
+{
+	uint32_t ps = nui_pixel_size(s->format);
+	for (int32_t y = r->top; y < r->bottom; y++) {
+		uint8_t *row = (uint8_t*)s->pixels + (size_t)y * s->stride;
+		for (int32_t x = r->left; x < r->right; x++) {
+			// Mix of flat areas, few colors and noise so every tile type is used
+			uint32_t v;
+			switch (pattern % 4) {
+			case 0: v = pattern * 0x01010101u; break;
+			case 1: v = ((x / 3 + y / 5) % 5) * 0x11223344u; break;
+			case 2: v = (uint32_t)(x / 9) * 0x01020304u; break;
+			default: v = next_random() * 0x9e3779b9u; break;
+			}
+			memcpy(row + (size_t)x * ps, &v, ps);
+		}
+	}
+}
+
+static int same_pixels(const nui_surface *a, const nui_surface *b)
+{
+	size_t row_size = (size_t)a->width * nui_pixel_size(a->format);
+	for (int32_t y = 0; y < a->height; y++) {
+		if (memcmp((const char*)a->pixels + (size_t)y * a->stride, (const char*)b->pixels + (size_t)y * b->stride, row_size)) return 0;
+	}
+	return 1;
+}
+
+static void test_format(nui_pixel_format format)
+{
+	uint32_t ps = nui_pixel_size(format);
+	size_t size = (size_t)WIDTH * HEIGHT * ps;
+	nui_surface src = { malloc(size), WIDTH, HEIGHT, WIDTH * (int32_t)ps, format };
+	nui_surface dst = { malloc(size), WIDTH, HEIGHT, WIDTH * (int32_t)ps, format };
+	void *backup = malloc(size);
+	uint8_t *corrupt = NULL;
+
+	nui_rect full = { { { { 0, 0 }, { WIDTH, HEIGHT } } } };
+	fill(&src, &full, 3);
+	memset(dst.pixels, 0, size);
+
+	nui_delta_encoder *e = nui_make_delta_encoder(nui_ex(WIDTH, HEIGHT), format);
+	for (uint32_t frame = 0; frame < 40; frame++) {
+		nui_rect damage[4];
+		uint32_t num_damage = frame % 4 + 1;
+		for (uint32_t i = 0; i < num_damage; i++) {
+			int32_t x = (int32_t)(next_random() % WIDTH), y = (int32_t)(next_random() % HEIGHT);
+			damage[i].left = x;
+			damage[i].top = y;
+			damage[i].right = nui_min(x + 1 + (int32_t)(next_random() % 80), WIDTH);
+			damage[i].bottom = nui_min(y + 1 + (int32_t)(next_random() % 60), HEIGHT);
+			fill(&src, &damage[i], frame + i);
+		}
+
+		size_t data_size;
+		const uint8_t *data = (const uint8_t*)nui_delta_encode(e, &src, damage, num_damage, &data_size);
+
+		// Every truncation and some corruptions fail without touching `dst`
+		memcpy(backup, dst.pixels, size);
+		for (size_t len = 0; len < data_size; len += 1 + len / 16) {
+			CHECK(!nui_delta_decode(&dst, data, len));
+			CHECK(!memcmp(backup, dst.pixels, size));
+		}
+		corrupt = (uint8_t*)realloc(corrupt, data_size);
+		// Past the 16 byte header, which is checked up front
+		for (uint32_t i = 0; i < 64 && data_size > 16; i++) {
+			memcpy(corrupt, data, data_size);
+			corrupt[16 + next_random() % (data_size - 16)] ^= (uint8_t)(1 + next_random() % 255);
+			if (!nui_delta_decode(&dst, corrupt, data_size)) {
+				CHECK(!memcmp(backup, dst.pixels, size));
+			}
+			memcpy(dst.pixels, backup, size);
+		}
+
+		CHECK(nui_delta_decode(&dst, data, data_size));
+		CHECK(same_pixels(&src, &dst));
+	}
+
+	// A fresh encoder after reset re-sends everything
+	nui_delta_reset(e);
+	memset(dst.pixels, 0, size);
+	size_t data_size;
+	const void *data = nui_delta_encode(e, &src, NULL, 0, &data_size);
+	CHECK(nui_delta_decode(&dst, data, data_size));
+	CHECK(same_pixels(&src, &dst));
+
+	nui_free_delta_encoder(e);
+	free(corrupt);
+	free(backup);
+	free(src.pixels);
+	free(dst.pixels);
+}
+
+static void benchmark(void)
+{
+	enum { width = 1280, height = 800, frames = 50 };
+	size_t size = (size_t)width * height * 4;
+	nui_surface src = { malloc(size), width, height, width * 4, nui_pf_bgra8 };
+	nui_surface dst = { malloc(size), width, height, width * 4, nui_pf_bgra8 };
+	nui_rect full = { { { { 0, 0 }, { width, height } } } };
+	fill(&src, &full, 1);
+
+	nui_delta_encoder *e = nui_make_delta_encoder(nui_ex(width, height), nui_pf_bgra8);
+	uint64_t encode_ticks = 0, decode_ticks = 0;
+	size_t total_size = 0;
+	for (uint32_t frame = 0; frame < frames; frame++) {
+		// Typical UI update: a text line and a highlight move
+		nui_rect damage[2] = {
+			{ { { { 40, (int32_t)(frame * 13 % 700) }, { 640, (int32_t)(frame * 13 % 700) + 20 } } } },
+			{ { { { 900, 100 }, { 1100, 400 } } } },
+		};
+		fill(&src, &damage[0], frame % 3);
+		fill(&src, &damage[1], 1 + frame % 2);
+
+		uint64_t t0 = nui_trace_time();
+		size_t data_size;
+		const void *data = nui_delta_encode(e, &src, damage, 2, &data_size);
+		uint64_t t1 = nui_trace_time();
+		CHECK(nui_delta_decode(&dst, data, data_size));
+		uint64_t t2 = nui_trace_time();
+
+		// The first frame is a keyframe
+		if (frame == 0) continue;
+		encode_ticks += t1 - t0;
+		decode_ticks += t2 - t1;
+		total_size += data_size;
+	}
+	CHECK(same_pixels(&src, &dst));
+	printf("test_delta: %dx%d, %.1f us encode, %.1f us decode, %zu bytes per frame\n", width, height,
+		nui_trace_ticks_to_us(encode_ticks) / (frames - 1), nui_trace_ticks_to_us(decode_ticks) / (frames - 1),
+		total_size / (frames - 1));
+
+	nui_free_delta_encoder(e);
+	free(src.pixels);
+	free(dst.pixels);
+}
+
+int main(void)
+{
+	test_format(nui_pf_bgra8);
+	test_format(nui_pf_rgba8);
+	test_format(nui_pf_rgb565);
+	test_format(nui_pf_a8);
+	benchmark();
+	printf("test_delta: ok\n");
+	return 0;
+}
@@ -0,0 +1,95 @@
+// Layers drawn more than once are rendered once by the soft renderer and
+// copied to each instance. The copy must not survive an image being freed
+// and replaced by a new one at the same address.
+//
+//   cc -std=c11 -Isrc test/test_instances.c src/nui_base.c src/nui_canvas.c
+//      src/nui_renderer_soft.c src/nui_trace.c -lm
+
+#include "test.h"
+#include "nui_renderer_soft.h"
+
+#define WIDTH 64
+#define HEIGHT 32
+#define MAX_SPARE 256
+#define NUM_FILLER 16
+
+static uint32_t g_screen[WIDTH * HEIGHT];
+
+static void render(nui_canvas *c, nui_layer *root)
+{
+	nui_surface s = { g_screen, WIDTH, HEIGHT, WIDTH * 4, nui_pf_bgra8 };
+	nui_render_info ri = { root, {{{{ 0, 0 }, { WIDTH, HEIGHT }}}}, { 0, 0 }, nui_rgb(0) };
+	nui_begin_rendering(c);
+	nui_soft_render(&s, &ri);
+	nui_end_rendering(c);
+}
+
+static void check_instances(uint32_t pixel)
+{
+	CHECK(g_screen[5 * WIDTH + 5] == pixel);
+	CHECK(g_screen[5 * WIDTH + 37] == pixel);
+}
+
+int main(void)
+{
+	nui_canvas *c = nui_make_canvas(nui_soft_renderer_make(NULL));
+	nui_layer *icon = nui_make_layer(c, nui_ex(16, 16));
+	nui_layer *root = nui_make_layer(c, nui_ex(WIDTH, HEIGHT));
+	nui_draw_layer(root, nui_pt(0, 0), icon);
+	nui_draw_layer(root, nui_pt(32, 0), icon);
+	CHECK(nui_layer_num_instances(icon) == 2);
+
+	static uint32_t red[16 * 16], green[16 * 16];
+	for (uint32_t i = 0; i < 16 * 16; i++) {
+		red[i] = 0xffff0000u;
+		green[i] = 0xff00ff00u;
+	}
+	nui_rect rect = {{{{ 0, 0 }, { 16, 16 }}}};
+
+	nui_image_desc desc = { red, 16, 16, 16 * 4 };
+	nui_image *image = nui_make_image(&desc, NULL, NULL);
+	nui_draw_image(icon, &rect, image, NULL, nui_if_nearest);
+	render(c, root);
+	check_instances(0xffff0000u);
+
+	// Release every reference to the image without rendering in between
+	nui_clear(icon);
+	nui_clear(icon);
+	uintptr_t address = (uintptr_t)image;
+
+	// Free a few images of the same size first, glibc caches recently freed
+	// chunks per size but calloc() skips that cache, so make the image land
+	// behind it where both allocation paths find it
+	nui_image *filler[NUM_FILLER];
+	for (uint32_t i = 0; i < NUM_FILLER; i++) {
+		filler[i] = nui_make_image(&desc, NULL, NULL);
+	}
+	for (uint32_t i = 0; i < NUM_FILLER; i++) {
+		nui_free_image(filler[i]);
+	}
+	nui_free_image(image);
+
+	// Allocate until the freed address comes back
+	desc.pixels = green;
+	nui_image *spare[MAX_SPARE];
+	uint32_t num_spare = 0;
+	nui_image *reused = nui_make_image(&desc, NULL, NULL);
+	while ((uintptr_t)reused != address && num_spare < MAX_SPARE) {
+		spare[num_spare++] = reused;
+		reused = nui_make_image(&desc, NULL, NULL);
+	}
+	if ((uintptr_t)reused != address) {
+		fprintf(stderr, "note: image address not reused, check is weaker\n");
+	}
+	nui_clear(icon);
+	nui_draw_image(icon, &rect, reused, NULL, nui_if_nearest);
+	render(c, root);
+	check_instances(0xff00ff00u);
+
+	nui_free_image(reused);
+	for (uint32_t i = 0; i < num_spare; i++) {
+		nui_free_image(spare[i]);
+	}
+	nui_free_canvas(c);
+	return 0;
+}
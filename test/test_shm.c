@@ -0,0 +1,143 @@
+// Forks a consumer that composes received frames onto its own screen copy
+// using only the damage rects and checks the result matches the frame the
+// producer presented last, including buffer catch-up when frames skip
+// buffers.
+//
+//   cc -std=c11 -Isrc test/test_shm.c src/nui_base.c src/nui_canvas.c
+//      src/nui_renderer_soft.c src/nui_shm.c src/nui_trace.c -lm
+
+#if defined(__linux__)
+
+#include "test.h"
+#include "nui_shm.h"
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define WIDTH 64
+#define HEIGHT 48
+#define NUM_FRAMES 60
+
+static uint64_t checksum(const uint32_t *pixels)
+{
+	uint64_t sum = 0;
+	for (uint32_t i = 0; i < WIDTH * HEIGHT; i++) {
+		sum = sum * 31 + pixels[i];
+	}
+	return sum;
+}
+
+static void run_consumer(int socket, int result)
+{
+	nui_shm_consumer *c = nui_make_shm_consumer(socket);
+	CHECK(c);
+
+	static uint32_t screen[WIDTH * HEIGHT];
+	nui_surface s = { screen, WIDTH, HEIGHT, WIDTH * 4, nui_pf_bgra8 };
+
+	nui_shm_frame frame, prev;
+	int have_prev = 0;
+	uint32_t num_frames = 0;
+	while (nui_shm_receive(c, &frame)) {
+		for (uint32_t i = 0; i < frame.num_damage; i++) {
+			nui_soft_convert(&s, &frame.surface, &frame.damage[i]);
+		}
+		// Hold two frames at a time so the producer has to skip buffers
+		if (have_prev) nui_shm_release(c, &prev);
+		prev = frame;
+		have_prev = 1;
+		num_frames++;
+	}
+
+	uint64_t sum = checksum(screen);
+	CHECK(num_frames == NUM_FRAMES);
+	CHECK(write(result, &sum, sizeof(sum)) == sizeof(sum));
+	nui_free_shm_consumer(c);
+	_exit(0);
+}
+
+static void record(nui_layer *root, nui_layer *inner, int frame)
+{
+	nui_clear(root);
+	nui_rect r = { { { { frame % 40, 5 }, { frame % 40 + 8, 13 } } } };
+	nui_fill_rect(root, &r, nui_rgb(0xff0000));
+	nui_draw_layer(root, nui_pt(30, 20 + frame % 10), inner);
+
+	nui_clear(inner);
+	nui_rect q = { { { { 0, 0 }, { 4, 4 } } } };
+	nui_fill_rect(inner, &q, nui_rgb((uint32_t)frame * 1000));
+}
+
+int main(void)
+{
+	int sv[2], result[2];
+	CHECK(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) == 0);
+	CHECK(pipe(result) == 0);
+
+	pid_t pid = fork();
+	CHECK(pid >= 0);
+	if (pid == 0) {
+		close(sv[0]);
+		close(result[0]);
+		run_consumer(sv[1], result[1]);
+	}
+	close(sv[1]);
+	close(result[1]);
+
+	nui_canvas *c = nui_make_canvas(nui_soft_renderer_make(NULL));
+	nui_layer *root = nui_make_layer(c, nui_ex(WIDTH, HEIGHT));
+	nui_layer *inner = nui_make_layer(c, nui_ex(10, 10));
+	nui_set_bg_color(root, nui_rgb(0xffffff));
+	nui_set_bg_color(inner, nui_rgb(0x00ff00));
+
+	nui_shm_producer *p = nui_make_shm_producer(sv[0], nui_ex(WIDTH, HEIGHT), nui_pf_bgra8, 3);
+	CHECK(p);
+
+	nui_render_info ri;
+	memset(&ri, 0, sizeof(ri));
+	ri.layer = root;
+	ri.clip.max = nui_pt(WIDTH, HEIGHT);
+
+	static uint32_t last[WIDTH * HEIGHT];
+	for (int frame = 0; frame < NUM_FRAMES; frame++) {
+		record(root, inner, frame);
+		nui_begin_rendering(c);
+		nui_rect damage[NUI_SHM_MAX_DAMAGE];
+		uint32_t num_damage = nui_layer_damage(root, damage, NUI_SHM_MAX_DAMAGE);
+		nui_surface *s = nui_shm_acquire(p);
+		CHECK(s);
+		nui_soft_render(s, &ri);
+		nui_end_rendering(c);
+
+		for (int32_t y = 0; y < HEIGHT; y++) {
+			memcpy(last + y * WIDTH, (char*)s->pixels + y * s->stride, WIDTH * 4);
+		}
+		CHECK(nui_shm_present(p, damage, num_damage));
+	}
+	close(sv[0]);
+
+	uint64_t sum = 0;
+	CHECK(read(result[0], &sum, sizeof(sum)) == sizeof(sum));
+	CHECK(sum == checksum(last));
+
+	int status;
+	CHECK(waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+	nui_free_shm_producer(p);
+	nui_free_canvas(c);
+	printf("test_shm: ok\n");
+	return 0;
+}
+
+#else
+
+#include <stdio.h>
+
+int main(void)
+{
+	printf("test_shm: skipped, Linux only\n");
+	return 0;
+}
+
+#endif
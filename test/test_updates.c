@@ -0,0 +1,101 @@
+// Workers post updates while the rendering thread applies them, frees
+// layers and reuses their slots. Only the last update per layer takes
+// effect and updates posted against a freed layer never reach a layer
+// that later takes over its slot. Meant to also run under ThreadSanitizer.
+//
+//   cc -std=c11 -g -fsanitize=thread -Isrc test/test_updates.c
+//      src/nui_base.c src/nui_canvas.c src/nui_renderer_soft.c
+//      src/nui_trace.c -lm -lpthread
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "test.h"
+#include "nui_renderer_soft.h"
+#include <pthread.h>
+#include <time.h>
+
+#define NUM_LAYERS 32
+#define NUM_WORKERS 4
+#define NUM_VALUES 5000
+#define STALE_COLOR 0xff0000u
+
+static nui_layer_ref g_refs[NUM_LAYERS];
+static nui_layer_ref g_stale;
+static volatile uint64_t g_done;
+
+static void *worker(void *arg)
+{
+	uint32_t first = (uint32_t)(uintptr_t)arg * (NUM_LAYERS / NUM_WORKERS);
+	for (uint32_t v = 1; v <= NUM_VALUES; v++) {
+		for (uint32_t i = first; i < first + NUM_LAYERS / NUM_WORKERS; i++) {
+			while (!nui_post_bg_color(g_refs[i], nui_rgb(v))) { }
+			while (!nui_post_resize(g_refs[i], nui_ex(v % 100 + 1, v % 50 + 1))) { }
+		}
+		nui_post_bg_color(g_stale, nui_rgb(STALE_COLOR));
+	}
+	nui_atomic_add64(&g_done, 1);
+	return NULL;
+}
+
+int main(void)
+{
+	nui_canvas *c = nui_make_canvas(nui_soft_renderer_make(NULL));
+
+	// Stale references are dropped, fresh ones for the same slot apply
+	nui_layer *a = nui_make_layer(c, nui_ex(1, 1));
+	nui_layer_ref old = nui_layer_get_ref(a);
+	nui_free_layer(a);
+	nui_layer *b = nui_make_layer(c, nui_ex(1, 1));
+	CHECK(nui_layer_index(b) == old.index);
+	nui_color initial = nui_layer_bg_color(b);
+	CHECK(nui_post_bg_color(old, nui_rgb(STALE_COLOR)));
+	nui_begin_rendering(c);
+	nui_end_rendering(c);
+	CHECK(nui_color_eq(nui_layer_bg_color(b), initial));
+	CHECK(nui_post_bg_color(nui_layer_get_ref(b), nui_rgb(7)));
+	nui_begin_rendering(c);
+	nui_end_rendering(c);
+	CHECK(nui_color_eq(nui_layer_bg_color(b), nui_rgb(7)));
+	nui_free_layer(b);
+
+	nui_layer *layers[NUM_LAYERS];
+	for (uint32_t i = 0; i < NUM_LAYERS; i++) {
+		layers[i] = nui_make_layer(c, nui_ex(1, 1));
+		g_refs[i] = nui_layer_get_ref(layers[i]);
+	}
+
+	// The stale slot is taken over by a new layer every frame
+	nui_layer *victim = nui_make_layer(c, nui_ex(1, 1));
+	g_stale = nui_layer_get_ref(victim);
+	nui_free_layer(victim);
+
+	pthread_t threads[NUM_WORKERS];
+	for (uint32_t i = 0; i < NUM_WORKERS; i++) {
+		pthread_create(&threads[i], NULL, worker, (void*)(uintptr_t)i);
+	}
+
+	struct timespec pause = { 0, 50000 };
+	while (nui_atomic_load64(&g_done) < NUM_WORKERS) {
+		victim = nui_make_layer(c, nui_ex(1, 1));
+		CHECK(nui_layer_index(victim) == g_stale.index);
+		nui_begin_rendering(c);
+		nui_end_rendering(c);
+		CHECK(!nui_color_eq(nui_layer_bg_color(victim), nui_rgb(STALE_COLOR)));
+		nui_free_layer(victim);
+		nanosleep(&pause, NULL);
+	}
+	for (uint32_t i = 0; i < NUM_WORKERS; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	nui_begin_rendering(c);
+	nui_end_rendering(c);
+	for (uint32_t i = 0; i < NUM_LAYERS; i++) {
+		CHECK(nui_color_eq(nui_layer_bg_color(layers[i]), nui_rgb(NUM_VALUES)));
+		nui_extent size = nui_layer_size(layers[i]);
+		CHECK(size.x == NUM_VALUES % 100 + 1 && size.y == NUM_VALUES % 50 + 1);
+	}
+
+	nui_free_canvas(c);
+	return 0;
+}